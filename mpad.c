@@ -4,6 +4,7 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
 
 #include <termios.h>
 #include <unistd.h>
@@ -16,19 +17,68 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 
-#define DEFAULT_BUF_CAP 128 	// Default buffer line count
 #define DEFAULT_LINE_CAP 16 	// Default (empty) line cap
+#define LINE_WIDTH_STEP 4096 	// Bytes between display width checkpoints on long lines
+
+#define ROPE_LEAF_MAX 64 	// Lines per rope leaf
+#define ROPE_NODE_MAX 32 	// Children per rope interior node
+
+#define MMAP_LOAD_MIN (1 << 20) 	// Files at least this big are mapped, not read
+#define INDEX_STEP (4 << 20) 		// Bytes of the mapping indexed per step
+#define INDEX_THREAD_MIN (16 << 20) // Smallest slice worth its own indexing thread
+#define INDEX_MAX_THREADS 64
+#define READ_BLOCK (64 << 20) 		// Read size when loading unmapped files
+
+#define POOL_CHUNK_SIZE (1 << 20) 	// Line storage is carved out of chunks this big
+#define POOL_CLASSES 17 			// Block sizes from 16 bytes to 4 KB
+#define POOL_COMPACT_MIN (8 << 20) 	// Free pool bytes that make compaction worthwhile
+
+#define SAVE_IOV_BATCH 1024 		// iovecs per writev (Linux IOV_MAX)
+#define SAVE_IOV_MAX_LEN (1 << 30) 	// Longest single iovec when merging pieces
+
+#define INPUT_RING_SIZE (64 << 10) 	// Terminal input read ahead of the key parser
+#define ESC_TIMEOUT_MS 100 			// How long the rest of an escape sequence may take
+#define PASTE_IDLE_MAX 10 			// Read timeouts before giving up on a paste's end marker
+#define TYPEAHEAD_MAX_MS 100 		// Longest queued input may hold back a frame
+
+#define KW_SLOTS 256 			// Keyword hash slots per language, a power of two
+#define KW_SEED_TRIES (1 << 20) // Seeds tried for a collision-free keyword hash
+
+#define HL_MARGIN 64 			// Lines below the screen highlighted ahead of time
+#define HL_CATCHUP_MAX 4096 	// Furthest the frontier is walked to reach the screen in one frame
+#define HL_STEP 8192 			// Lines the frontier is moved per idle step or job
+#define HL_JOB_BYTES (1 << 20) 	// Text copied out for the highlighting thread per job
+
+#define UNDO_MEM_DEFAULT (64 << 20) // Undo log kept before the oldest steps go (:set undomem=<MB>)
+#define UNDO_COALESCE_MAX 4096 		// Longest backspaced run folded into one undo op
+
+#define JOURNAL_SYNC_MS 200 			// Longest an edit waits to be fsynced to the journal
+#define JOURNAL_FLUSH_BYTES (1 << 20) 	// Unwritten journal bytes that get written out right away
 
 #define ESC 27
 #define ENTER 13
 #define BACKSPACE 8
 #define DEL 127
 #define TAB 9
+#define CTRL_KEY(k) ((k) & 0x1f)
 
 #define TAB_WIDTH 4
 typedef struct {
@@ -43,13 +93,16 @@ typedef struct {
 typedef struct {
     size_t top_line;
     size_t top_rowoff; // Wrapped-row offset inside top_line
+    size_t left_col;   // First display column shown, with wrapping off
 } CurrentView;
 
 enum EditorKey {
+    NO_KEY = -1,    // Nothing typed, but something finished in the background
     ARROW_LEFT = 1000,
     ARROW_RIGHT,
     ARROW_UP,
-    ARROW_DOWN
+    ARROW_DOWN,
+    PASTE           // Bracketed paste began; editor_read_paste() gets the text
 };
 
 enum Mode {
@@ -58,22 +111,161 @@ enum Mode {
     COMMAND
 };
 
+// len bytes of a line from start that are drawn as hl
+typedef struct {
+    uint32_t start;
+    unsigned len : 29;
+    unsigned hl : 3;
+} HlSpan;
+#define HL_SPAN_MAX_LEN ((1u << 29) - 1)
+
+// A line with cap == 0 is a read-only view into the file
+// mapping; it gets a private copy the first time it's edited.
 typedef struct {
     char *data;
     size_t len;
     size_t cap;
 
-	unsigned char *hl;
+	// The line's runs that aren't HL_NORMAL, in order. A single run
+	// is kept in the Line itself (hl_cap == 0), more in the pool.
+	// Whether they're still good is in the leaf's hl_state.
+	union {
+		HlSpan *hl_spans;
+		HlSpan hl_inline;
+	};
 	size_t hl_cap;
-	bool hl_open_comment;
+	uint32_t hl_n;
+
+    // Lines longer than LINE_WIDTH_STEP remember the display column
+    // at every LINE_WIDTH_STEP bytes once they've been measured, so
+    // any prefix width is at most one step of scanning away.
+    int *width_ckpt;
 } Line;
 
+// Bits of a leaf's hl_state[]: the line's runs are good, which of
+// the language's multiline blocks (1 or 2, 0 for none) they were
+// worked out starting in, and which one the line ends in
+enum LineHlState {
+    HLS_OK = 1,
+    HLS_IN_COMMENT = 2,     // Two bits of block number
+    HLS_OPEN_COMMENT = 8    // Two more
+};
+#define HLS_BLOCK_MASK 3
+
+static unsigned char hls_make(int in_block, int open_block) {
+    return (unsigned char)(HLS_OK | in_block * HLS_IN_COMMENT | open_block * HLS_OPEN_COMMENT);
+}
+
+// The block a line with hl_state st ends in
+static int hls_open(unsigned char st) {
+    return (st / HLS_OPEN_COMMENT) & HLS_BLOCK_MASK;
+}
+
+// The buffer is a rope of lines: a B+ tree whose leaves hold
+// runs of Line structs and whose interior nodes know how many
+// lines sit below them, so lookup/insert/delete by line index
+// are O(log n) instead of shifting one big array around.
+//
+// A leaf of a memory-mapped file starts out as just a span of
+// the mapping; its Line structs are only built when it's visited.
+typedef struct RopeNode {
+    size_t count;   // Lines in this subtree
+    int n;          // Used slots in lines[] (leaf) or kids[] (interior)
+    bool leaf;
+
+    // Wrapped screen rows of this subtree at text width rows_width;
+    // rows_width == 0 when an edit below has made it stale
+    size_t rows;
+    int rows_width;
+
+    Line *lines;              // Leaf lines, NULL while still a span
+    // Metadata of lines[i] that whole ranges get scanned for, kept
+    // out of the Line so those scans only read a few bytes a line
+    int *widths;              // Display width, -1 until measured
+    unsigned char *hl_state;  // LineHlState bits
+    const char *span;         // Leaf text in the mapping, until expanded
+    size_t span_len;
+    struct RopeNode **kids;   // Interior children
+} RopeNode;
+
+typedef struct PoolChunk {
+    struct PoolChunk *next;
+} PoolChunk;
+
+typedef struct PoolBig {
+    struct PoolBig *next, *prev;
+} PoolBig;
+
+typedef struct {
+    PoolChunk *chunks;
+    char *bump;             // Unused tail of the newest chunk
+    char *bump_end;
+    void *free[POOL_CLASSES];   // Freed blocks, linked through their first bytes
+    size_t free_bytes;
+    PoolBig *big;
+} LinePool;
+
 typedef struct {
-    Line *lines;
+    RopeNode *root;
     size_t line_count;
-    size_t cap;
+    LinePool pool;
+
+    // Last leaf found by buffer_line(), so sequential
+    // access doesn't walk down from the root every time
+    RopeNode *cache_leaf;
+    size_t cache_start;
+
+    // Read-only file mapping for large files. Only the first
+    // map_scanned bytes have been split into lines so far.
+    const char *map;
+    size_t map_len;
+    size_t map_scanned;
+
+    // Lines before hl_valid are highlighted from the right
+    // comment state; edits pull it back to where they happened
+    // and bump hl_version
+    size_t hl_valid;
+    unsigned long hl_version;
 } Buffer;
 
+// An edit is undone by knowing the text it put in or took out at
+// a spot in the buffer, so undoing costs as much as the edit did
+enum UndoKind {
+    UNDO_INSERT,
+    UNDO_DELETE
+};
+
+typedef struct {
+    size_t row, col;    // Where the text starts
+    size_t len;         // Bytes of text after this header
+    unsigned char kind;
+    bool group;         // First op of an undo step
+} UndoOp;
+
+// Ops are packed back to back as header, text, then the op's size
+// again so the log can be walked backwards. Those before pos can
+// be undone, those from pos on redone.
+typedef struct {
+    char *log;
+    size_t len, cap;
+    size_t pos;
+    size_t last;            // Offset of the newest op, SIZE_MAX if none
+    size_t end_row;         // Where the newest op ends, if it's an insert
+    size_t end_col;
+    bool new_group;         // The next op starts a new step
+    bool lost;              // This step was too big to keep
+    size_t limit;           // Bytes of log kept
+} UndoLog;
+
+// The pattern of the last / or ? search, with its Horspool shifts
+typedef struct {
+    char pat[64];
+    size_t len;
+    unsigned char skip[256];    // How far a mismatch under the last byte moves
+    bool backward;              // Was it a ? search
+    bool show;                  // Highlight the matches on screen
+} Search;
+
 /* For syntax highlighting */
 enum Highlight {
 	HL_NORMAL = 0,
@@ -84,6 +276,49 @@ enum Highlight {
 	HL_KEYWORD
 };
 
+// Screen cells are coloured by highlight class, plus a
+// couple of faces that only the editor chrome uses
+enum CellAttr {
+    ATTR_GUTTER = HL_KEYWORD + 1,
+    ATTR_STATUS,
+    ATTR_MATCH,
+    ATTR_COUNT
+};
+
+// Grows geometrically and keeps its memory across abClear(),
+// so a buffer reused frame after frame stops allocating once
+// it has seen the biggest frame.
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+    unsigned long allocs;   // Times the buffer has had to grow
+};
+#define ABUF_INIT {NULL, 0, 0, 0}
+
+// One full screen of cells, as parallel character and
+// attribute planes of rows * cols each
+typedef struct {
+    char *text;
+    unsigned char *attr;
+} Frame;
+
+// The screen is drawn into back and then diffed against
+// front, which mirrors what the terminal is showing, so
+// only the cells that actually changed get written out.
+typedef struct {
+    int rows, cols;
+    Frame front, back;
+    bool valid;     // front matches the terminal
+    int cy, cx;     // Terminal cursor, -1 if unknown
+    int sgr;        // Attribute the terminal is drawing with, -1 if unknown
+
+    struct abuf out;        // Escape output, reused every frame
+    unsigned long allocs;   // Heap allocations made by the screen so far
+    size_t frame_bytes;     // Output size and allocations of the last frame
+    unsigned long frame_allocs;
+} Screen;
+
 enum Language {
     C,
     PYTHON,
@@ -185,7 +420,7 @@ static const char *CSHARP_KEYWORDS[] = {
 
 Buffer global_buffer;
 Cursor global_cursor;
-CurrentView global_view = {0, 0}; 
+CurrentView global_view = {0, 0, 0}; 
 struct termios orig_termios;
 
 static const char *global_filename = NULL;
@@ -199,19 +434,74 @@ static char global_control_char = ' ';
 // but not yet synced with file
 static bool global_dirty = false;
 
+// Bumped by every edit, so a finished background save can
+// tell whether the buffer changed after its snapshot
+static unsigned long global_edit_seq = 0;
+
+static UndoLog global_undo = { .last = SIZE_MAX, .new_group = true, .limit = UNDO_MEM_DEFAULT };
+
+// Background save in flight, if save_pid != -1
+static pid_t save_pid = -1;
+static int save_pipe = -1;
+static unsigned long save_edit_seq = 0;
+static char *save_path = NULL;
+static uint64_t save_journal_mark = 0;
+
 static char global_status[128] = "";
 static char global_cmd[64] = "";
+static char global_cmd_prompt = ':';    // ':' for commands, '/' or '?' for a search
+
+static Search global_search;
+static Search search_saved;     // The search to go back to if the prompt is cancelled
+static Cursor search_origin;    // Where the cursor was when the prompt opened
 static size_t global_cmd_len = 0;
 
 static bool line_num = true;
 
+// Soft wrap long lines (:set wrap / :set nowrap)
+static bool global_wrap = true;
+
+// Shortest time between two frames (:set frametime=<ms>). Keys
+// that come in quicker than this are handled without drawing
+// each one.
+static int global_frame_ms = 0;
+
+static Screen global_screen;
+
 static bool editor_running = true;
 
+// Terminal input is read in big chunks into this ring and parsed
+// into keys from there; head and tail only ever grow
+static char input_ring[INPUT_RING_SIZE];
+static size_t input_head = 0;
+static size_t input_tail = 0;
+
+// Terminal size, refreshed only when SIGWINCH says it changed
+static int global_rows = -1;
+static int global_cols = -1;
+
+// SIGWINCH writes a byte here so the event loop's poll() wakes up
+static int winch_pipe[2] = {-1, -1};
+
+// The highlighting thread writes a byte here when it finishes a job
+static int hl_pipe[2] = {-1, -1};
+static bool hl_running = false;     // The highlighting thread is up
+static bool hl_in_flight = false;   // It has a job that hasn't been collected
+
+// Something happened since the last frame was drawn at last_frame_time
+static bool frame_pending = true;
+static struct timespec last_frame_time;
+
+// Where the last frame's view was, to tell how far the next one scrolled
+static CurrentView drawn_view;
+static int drawn_text_cols = -1;
+static bool drawn_wrap = true;
+
 
 /* -------- misc helpers ------- */
 
 static void die(const char *msg) {
-    write(STDOUT_FILENO, "\x1b[?25h\x1b[2J\x1b[H", 13);
+    write(STDOUT_FILENO, "\x1b[m\x1b[?25h\x1b[2J\x1b[H", 16);
     perror(msg);
     exit(1);
 }
@@ -229,165 +519,831 @@ int get_window_size(int *rows, int *cols) {
 
 /* ------ dynamic append buffer ------- */
 
-struct abuf {
-    char *b;
-    int len;
-};
-#define ABUF_INIT {NULL, 0}
+// (struct abuf is declared with the types, the screen embeds one)
 
-static void abAppend(struct abuf *ab, const char *s, int len) {
-    char *newbuf = realloc(ab->b, (size_t)ab->len + (size_t)len);
+static void abReserve(struct abuf *ab, int extra) {
+    if (ab->len + extra <= ab->cap) return;
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + extra) cap *= 2;
+    char *newbuf = realloc(ab->b, (size_t)cap);
     if (!newbuf) die("realloc");
-    memcpy(&newbuf[ab->len], s, (size_t)len);
     ab->b = newbuf;
+    ab->cap = cap;
+    ab->allocs++;
+}
+
+static void abAppend(struct abuf *ab, const char *s, int len) {
+    abReserve(ab, len);
+    memcpy(&ab->b[ab->len], s, (size_t)len);
     ab->len += len;
 }
 
+// Writes v in decimal into out, returns the number of digits
+static int format_uint(char *out, size_t v) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    for (int i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+    return n;
+}
+
+static void abAppendUint(struct abuf *ab, size_t v) {
+    abReserve(ab, 20);
+    ab->len += format_uint(&ab->b[ab->len], v);
+}
+
+static void abClear(struct abuf *ab) {
+    ab->len = 0;
+}
+
 static void abFree(struct abuf *ab) {
     free(ab->b);
 }
 
+/* ----- line storage pool ------- */
+
+// Line text and highlight bytes come from a per-buffer pool. Small
+// blocks are bumped out of POOL_CHUNK_SIZE chunks in fixed size
+// classes and recycled through per-class free lists; anything bigger
+// than the largest class is a plain malloc kept on a list. Tearing
+// down a buffer frees chunks, not lines.
+
+static const size_t POOL_CLASS_SIZES[POOL_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+#define POOL_MAX_BLOCK 4096
+#define POOL_BIG_HDR ((sizeof(PoolBig) + 15) & ~(size_t)15)
+
+static int pool_class(size_t size) {
+    if (size > POOL_MAX_BLOCK) return -1;
+    int cls = 0;
+    while (POOL_CLASS_SIZES[cls] < size) cls++;
+    return cls;
+}
+
+static void *pool_alloc(LinePool *p, size_t size, size_t *cap) {
+    int cls = pool_class(size);
+    if (cls < 0) {
+        PoolBig *big = malloc(POOL_BIG_HDR + size);
+        if (!big) die("malloc");
+        big->prev = NULL;
+        big->next = p->big;
+        if (p->big) p->big->prev = big;
+        p->big = big;
+        *cap = size;
+        return (char *)big + POOL_BIG_HDR;
+    }
+
+    size_t bsize = POOL_CLASS_SIZES[cls];
+    *cap = bsize;
+
+    if (p->free[cls]) {
+        void *blk = p->free[cls];
+        p->free[cls] = *(void **)blk;
+        p->free_bytes -= bsize;
+        return blk;
+    }
+
+    if ((size_t)(p->bump_end - p->bump) < bsize) {
+        PoolChunk *c = malloc(POOL_CHUNK_SIZE);
+        if (!c) die("malloc");
+        c->next = p->chunks;
+        p->chunks = c;
+        p->bump = (char *)c + sizeof(PoolChunk);
+        p->bump_end = (char *)c + POOL_CHUNK_SIZE;
+    }
+    void *blk = p->bump;
+    p->bump += bsize;
+    return blk;
+}
+
+// cap must be what pool_alloc handed back for ptr.
+static void pool_free(LinePool *p, void *ptr, size_t cap) {
+    if (!ptr || cap == 0) return;
+
+    if (cap > POOL_MAX_BLOCK) {
+        PoolBig *big = (PoolBig *)((char *)ptr - POOL_BIG_HDR);
+        if (big->prev) big->prev->next = big->next;
+        else p->big = big->next;
+        if (big->next) big->next->prev = big->prev;
+        free(big);
+        return;
+    }
+
+    int cls = pool_class(cap);
+    *(void **)ptr = p->free[cls];
+    p->free[cls] = ptr;
+    p->free_bytes += cap;
+}
+
+static void pool_release(LinePool *p) {
+    for (PoolChunk *c = p->chunks; c; ) {
+        PoolChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    for (PoolBig *big = p->big; big; ) {
+        PoolBig *next = big->next;
+        free(big);
+        big = next;
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+/* ----- line rope ------- */
+
+static void line_width_forget(Line *l) {
+    free(l->width_ckpt);
+    l->width_ckpt = NULL;
+}
+
+// Gives a leaf room for ROPE_LEAF_MAX lines, none measured or
+// highlighted yet.
+static void rope_leaf_alloc(RopeNode *node) {
+    node->lines = calloc(ROPE_LEAF_MAX, sizeof(Line));
+    node->widths = malloc(ROPE_LEAF_MAX * sizeof(int));
+    node->hl_state = calloc(ROPE_LEAF_MAX, 1);
+    if (!node->lines || !node->widths || !node->hl_state) die("calloc");
+    for (int i = 0; i < ROPE_LEAF_MAX; i++) node->widths[i] = -1;
+}
+
+// Moves n lines, with their metadata, between (or within) leaves.
+static void rope_leaf_move(RopeNode *dst, int to, RopeNode *src, int from, int n) {
+    memmove(&dst->lines[to], &src->lines[from], (size_t)n * sizeof(Line));
+    memmove(&dst->widths[to], &src->widths[from], (size_t)n * sizeof(int));
+    memmove(&dst->hl_state[to], &src->hl_state[from], (size_t)n);
+}
+
+static RopeNode *rope_node_new(bool leaf) {
+    RopeNode *n = calloc(1, sizeof(RopeNode));
+    if (!n) die("calloc");
+    n->leaf = leaf;
+    if (leaf) {
+        rope_leaf_alloc(n);
+    } else {
+        n->kids = calloc(ROPE_NODE_MAX, sizeof(RopeNode *));
+        if (!n->kids) die("calloc");
+    }
+    return n;
+}
+
+// A leaf covering n lines of mapped text, without any Line structs yet.
+static RopeNode *rope_span_new(const char *span, size_t span_len, int n) {
+    RopeNode *node = calloc(1, sizeof(RopeNode));
+    if (!node) die("calloc");
+    node->leaf = true;
+    node->span = span;
+    node->span_len = span_len;
+    node->n = n;
+    node->count = (size_t)n;
+    return node;
+}
+
+// Frees the node itself, but not the lines or nodes it points to.
+static void rope_node_release(RopeNode *node) {
+    free(node->lines);
+    free(node->widths);
+    free(node->hl_state);
+    free(node->kids);
+    free(node);
+}
+
+// Line text lives in the buffer's pool, which is freed as a whole.
+static void rope_node_free(RopeNode *node) {
+    if (!node) return;
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; i++) rope_node_free(node->kids[i]);
+    } else if (node->lines) {
+        for (int i = 0; i < node->n; i++) free(node->lines[i].width_ckpt);
+    }
+    rope_node_release(node);
+}
+
+// Splits a span leaf into view Lines pointing at the mapping.
+static void rope_leaf_expand(RopeNode *node) {
+    if (node->lines) return;
+
+    rope_leaf_alloc(node);
+
+    const char *p = node->span;
+    const char *end = node->span + node->span_len;
+    for (int i = 0; i < node->n; i++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t len = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        node->lines[i].data = (char *)p;
+        node->lines[i].len = len;
+        p = nl ? nl + 1 : end;
+    }
+    node->span = NULL;
+    node->span_len = 0;
+}
+
+// Which child of an interior node holds line idx? Rewrites idx
+// to be relative to that child. idx == node->count picks the
+// last child (append position).
+static int rope_child_for(const RopeNode *node, size_t *idx) {
+    int i = 0;
+    while (i < node->n - 1 && *idx >= node->kids[i]->count) {
+        *idx -= node->kids[i]->count;
+        i++;
+    }
+    return i;
+}
+
+// Inserts l at idx below node. If node had to split, returns the
+// new right sibling for the caller to link in, otherwise NULL.
+static RopeNode *rope_node_insert(RopeNode *node, size_t idx, const Line *l) {
+    node->rows_width = 0;
+    if (node->leaf) {
+        rope_leaf_expand(node);
+
+        size_t pos = MIN(idx, (size_t)node->n);
+        RopeNode *right = NULL;
+        RopeNode *dst = node;
+
+        if (node->n == ROPE_LEAF_MAX) {
+            // Appending at the very end keeps the left leaf full so
+            // sequential loads don't leave every leaf half empty
+            int split = (pos == (size_t)node->n) ? node->n : node->n / 2;
+            right = rope_node_new(true);
+            right->n = node->n - split;
+            rope_leaf_move(right, 0, node, split, right->n);
+            right->count = (size_t)right->n;
+            node->n = split;
+            node->count = (size_t)split;
+            if (pos >= (size_t)split) {
+                dst = right;
+                pos -= (size_t)split;
+            }
+        }
+
+        rope_leaf_move(dst, (int)pos + 1, dst, (int)pos, dst->n - (int)pos);
+        dst->lines[pos] = *l;
+        dst->widths[pos] = -1;
+        dst->hl_state[pos] = 0;
+        dst->n++;
+        dst->count++;
+        return right;
+    }
+
+    int i = rope_child_for(node, &idx);
+    RopeNode *split_kid = rope_node_insert(node->kids[i], idx, l);
+    node->count++;
+    if (!split_kid) return NULL;
+
+    int pos = i + 1;
+    RopeNode *right = NULL;
+    RopeNode *dst = node;
+
+    if (node->n == ROPE_NODE_MAX) {
+        int split = (pos == node->n) ? node->n : node->n / 2;
+        right = rope_node_new(false);
+        right->n = node->n - split;
+        memcpy(right->kids, &node->kids[split], (size_t)right->n * sizeof(RopeNode *));
+        node->n = split;
+
+        right->count = 0;
+        for (int k = 0; k < right->n; k++) right->count += right->kids[k]->count;
+        node->count = 0;
+        for (int k = 0; k < node->n; k++) node->count += node->kids[k]->count;
+
+        if (pos > split || (pos == split && split == ROPE_NODE_MAX)) {
+            dst = right;
+            pos -= split;
+        }
+    }
+
+    memmove(&dst->kids[pos + 1], &dst->kids[pos], (size_t)(dst->n - pos) * sizeof(RopeNode *));
+    dst->kids[pos] = split_kid;
+    dst->n++;
+    // Without a split node->count already covers the new kid's lines;
+    // after one both halves were recounted without it
+    if (right) dst->count += split_kid->count;
+    return right;
+}
+
+// Appends a whole leaf after the last one. Like rope_node_insert,
+// returns a split-off right sibling or NULL.
+static RopeNode *rope_node_push_leaf(RopeNode *node, RopeNode *leaf) {
+    RopeNode *add = leaf;
+    node->rows_width = 0;
+    if (!node->kids[0]->leaf) {
+        add = rope_node_push_leaf(node->kids[node->n - 1], leaf);
+        if (!add) {
+            node->count += leaf->count;
+            return NULL;
+        }
+    }
+
+    if (node->n < ROPE_NODE_MAX) {
+        node->kids[node->n++] = add;
+        node->count += leaf->count;
+        return NULL;
+    }
+
+    RopeNode *right = rope_node_new(false);
+    right->kids[0] = add;
+    right->n = 1;
+    right->count = leaf->count;
+    return right;
+}
+
+// Folds kids[i+1] into kids[i] when both fit in one node.
+static void rope_try_merge(RopeNode *node, int i) {
+    if (i < 0 || i + 1 >= node->n) return;
+    RopeNode *a = node->kids[i];
+    RopeNode *b = node->kids[i + 1];
+    int max = a->leaf ? ROPE_LEAF_MAX : ROPE_NODE_MAX;
+    if (a->n + b->n > max) return;
+
+    if (a->leaf) {
+        rope_leaf_expand(a);
+        rope_leaf_expand(b);
+        rope_leaf_move(a, a->n, b, 0, b->n);
+    } else {
+        memcpy(&a->kids[a->n], b->kids, (size_t)b->n * sizeof(RopeNode *));
+    }
+    a->n += b->n;
+    a->count += b->count;
+    a->rows_width = 0;
+    rope_node_release(b);
+
+    memmove(&node->kids[i + 1], &node->kids[i + 2], (size_t)(node->n - i - 2) * sizeof(RopeNode *));
+    node->n--;
+}
+
+// Removes line idx below node, handing it back through out.
+static void rope_node_delete(RopeNode *node, size_t idx, Line *out) {
+    node->rows_width = 0;
+    if (node->leaf) {
+        rope_leaf_expand(node);
+        *out = node->lines[idx];
+        rope_leaf_move(node, (int)idx, node, (int)idx + 1, node->n - (int)idx - 1);
+        node->n--;
+        node->count--;
+        return;
+    }
+
+    int i = rope_child_for(node, &idx);
+    RopeNode *kid = node->kids[i];
+    rope_node_delete(kid, idx, out);
+    node->count--;
+
+    if (kid->n == 0) {
+        rope_node_release(kid);
+        memmove(&node->kids[i], &node->kids[i + 1], (size_t)(node->n - i - 1) * sizeof(RopeNode *));
+        node->n--;
+        return;
+    }
+
+    // Keep nodes reasonably full so the tree stays shallow
+    int max = kid->leaf ? ROPE_LEAF_MAX : ROPE_NODE_MAX;
+    if (kid->n < max / 4) {
+        if (i + 1 < node->n) rope_try_merge(node, i);
+        else rope_try_merge(node, i - 1);
+    }
+}
+
+static Line *buffer_line(Buffer *b, size_t row) {
+    if (b->cache_leaf && row >= b->cache_start && row - b->cache_start < (size_t)b->cache_leaf->n) {
+        return &b->cache_leaf->lines[row - b->cache_start];
+    }
+
+    RopeNode *node = b->root;
+    size_t idx = row;
+    while (!node->leaf) {
+        int i = rope_child_for(node, &idx);
+        node = node->kids[i];
+    }
+    rope_leaf_expand(node);
+
+    b->cache_leaf = node;
+    b->cache_start = row - idx;
+    return &node->lines[idx];
+}
+
+// The LineHlState bits of a row
+static unsigned char *buffer_hl_state(Buffer *b, size_t row) {
+    buffer_line(b, row);
+    return &b->cache_leaf->hl_state[row - b->cache_start];
+}
+
+// Do hl_state bits say the row's runs are right when it
+// starts in block in_comment?
+static bool hl_state_fits(unsigned char st, int in_comment) {
+    return (st & HLS_OK) && ((st / HLS_IN_COMMENT) & HLS_BLOCK_MASK) == in_comment;
+}
+
+// Call after changing a line's text in place, so the cached
+// row counts on the way down to it and its highlighting get
+// recomputed.
+static void buffer_line_changed(Buffer *b, size_t row) {
+    b->hl_valid = MIN(b->hl_valid, row);
+    b->hl_version++;
+    RopeNode *node = b->root;
+    size_t idx = row;
+    node->rows_width = 0;
+    while (!node->leaf) {
+        int i = rope_child_for(node, &idx);
+        node = node->kids[i];
+        node->rows_width = 0;
+    }
+    if (node->lines) {
+        line_width_forget(&node->lines[idx]);
+        node->widths[idx] = -1;
+        node->hl_state[idx] = 0;
+    }
+}
+
+/* ----- line indexing ------- */
+
+// One slice of a file being indexed, and the offset of every
+// '\n' found in it. Big files are split into one slice per core.
+typedef struct {
+    const char *data;
+    size_t off;
+    size_t len;
+    size_t *nl;
+    size_t count;
+    size_t cap;
+} IndexChunk;
+
+typedef struct {
+    IndexChunk chunks[INDEX_MAX_THREADS];
+    int n;
+} LineIndex;
+
+static void index_chunk_push(IndexChunk *c, size_t off) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1024;
+        size_t *p = realloc(c->nl, c->cap * sizeof(size_t));
+        if (!p) die("realloc");
+        c->nl = p;
+    }
+    c->nl[c->count++] = off;
+}
+
+// Newline scan kernel: compares a whole vector of bytes against '\n'
+// at once and walks the set bits of the resulting mask. Line text
+// keeps any '\r', so only '\n' ends a line.
+static void *index_chunk_scan(void *arg) {
+    IndexChunk *c = arg;
+    const char *d = c->data;
+    size_t i = c->off;
+    size_t end = c->off + c->len;
+
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(d + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        while (mask) {
+            index_chunk_push(c, i + (size_t)__builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= end; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(d + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            index_chunk_push(c, i + (size_t)__builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // Scalar fallback, and the tail the vector loop didn't cover
+    while (i < end) {
+        const char *p = memchr(d + i, '\n', end - i);
+        if (!p) break;
+        i = (size_t)(p - d);
+        index_chunk_push(c, i);
+        i++;
+    }
+    return NULL;
+}
+
+// Finds every '\n' in data[off, off+len), spreading the
+// work across cores when there's enough of it.
+static void line_index_build(LineIndex *idx, const char *data, size_t off, size_t len) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t want = len / INDEX_THREAD_MIN;
+    int n = (int)MAX(1, MIN(want, (size_t)MIN(MAX(cpus, 1), INDEX_MAX_THREADS)));
+
+    memset(idx, 0, sizeof(*idx));
+    idx->n = n;
+
+    size_t per = len / (size_t)n;
+    for (int t = 0; t < n; t++) {
+        IndexChunk *c = &idx->chunks[t];
+        c->data = data;
+        c->off = off + (size_t)t * per;
+        c->len = (t == n - 1) ? len - (size_t)t * per : per;
+        c->cap = c->len / 32 + 16; // Guess at the line count
+        c->nl = malloc(c->cap * sizeof(size_t));
+        if (!c->nl) die("malloc");
+    }
+
+    if (n == 1) {
+        index_chunk_scan(&idx->chunks[0]);
+        return;
+    }
+
+    pthread_t tids[INDEX_MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < n; t++) {
+        if (pthread_create(&tids[t], NULL, index_chunk_scan, &idx->chunks[t]) != 0) break;
+        started++;
+    }
+    // Scan whatever didn't get a thread right here
+    for (int t = started; t < n; t++) index_chunk_scan(&idx->chunks[t]);
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+}
+
+static void line_index_free(LineIndex *idx) {
+    for (int t = 0; t < idx->n; t++) free(idx->chunks[t].nl);
+    idx->n = 0;
+}
+
+/* ----- mapped file indexing ------- */
+
+static bool buffer_indexing(const Buffer *b) {
+    return b->map && b->map_scanned < b->map_len;
+}
+
+static void buffer_push_leaf(Buffer *b, RopeNode *leaf) {
+    if (b->root->leaf && b->root->n == 0) {
+        rope_node_release(b->root);
+        b->root = leaf;
+    } else {
+        RopeNode *right = b->root->leaf ? leaf : rope_node_push_leaf(b->root, leaf);
+        if (right) {
+            RopeNode *root = rope_node_new(false);
+            root->kids[0] = b->root;
+            root->kids[1] = right;
+            root->n = 2;
+            root->count = b->root->count + right->count;
+            b->root = root;
+        }
+    }
+    b->line_count += leaf->count;
+}
+
+// Splits roughly the next budget bytes of the mapping into span
+// leaves of ROPE_LEAF_MAX lines each and appends them to the rope.
+static void buffer_index_step(Buffer *b, size_t budget) {
+    size_t start = b->map_scanned;
+    size_t stop = start + MIN(budget, b->map_len - start);
+
+    LineIndex idx;
+    line_index_build(&idx, b->map, start, stop - start);
+
+    size_t leaf_start = start;
+    size_t done = start; // Just past the last '\n' seen
+    int n = 0;
+    for (int t = 0; t < idx.n; t++) {
+        const IndexChunk *c = &idx.chunks[t];
+        for (size_t k = 0; k < c->count; k++) {
+            done = c->nl[k] + 1;
+            if (++n == ROPE_LEAF_MAX) {
+                buffer_push_leaf(b, rope_span_new(b->map + leaf_start, done - leaf_start, n));
+                leaf_start = done;
+                n = 0;
+            }
+        }
+    }
+    line_index_free(&idx);
+
+    if (done == start && stop < b->map_len) {
+        // One line longer than the whole budget: take all of it
+        const char *nl = memchr(b->map + stop, '\n', b->map_len - stop);
+        done = nl ? (size_t)(nl - b->map) + 1 : b->map_len;
+        n = 1;
+    } else if (stop == b->map_len && done < b->map_len) {
+        // Last line has no trailing newline
+        done = b->map_len;
+        n++;
+    }
+
+    if (n > 0) buffer_push_leaf(b, rope_span_new(b->map + leaf_start, done - leaf_start, n));
+    b->map_scanned = done;
+}
+
+static void buffer_index_all(Buffer *b) {
+    if (buffer_indexing(b)) buffer_index_step(b, b->map_len - b->map_scanned);
+}
+
+// Does line row exist? Indexes more of the mapping if it has to.
+static bool buffer_has_line(Buffer *b, size_t row) {
+    while (row >= b->line_count && buffer_indexing(b)) {
+        buffer_index_step(b, INDEX_STEP);
+    }
+    return row < b->line_count;
+}
+
 /* ----- buffer/line primitives ------- */
 
-static void line_reserve(Line *l, size_t needed) {
+// A private line holding a copy of text.
+static Line line_new(LinePool *pool, const char *text, size_t len) {
+    Line l = {0};
+    l.data = pool_alloc(pool, MAX(DEFAULT_LINE_CAP, len+1), &l.cap);
+    if (len) memcpy(l.data, text, len);
+    l.data[len] = '\0';
+    l.len = len;
+    return l;
+}
+
+// Grows l to hold needed bytes. A view into the file mapping
+// (cap == 0) gets its private copy here, on its first edit.
+static void line_reserve(LinePool *pool, Line *l, size_t needed) {
     if (needed <= l->cap) return;
-    if (l->cap == 0) l->cap = DEFAULT_LINE_CAP;
-    while (l->cap < needed) {
-        l->cap *= 2;
+    size_t cap = l->cap ? l->cap : DEFAULT_LINE_CAP;
+    while (cap < needed || cap <= l->len) {
+        cap *= 2;
     }
-    char *p = realloc(l->data, l->cap);
-    if (!p) die("realloc");
+
+    char *p = pool_alloc(pool, cap, &cap);
+    if (l->len) memcpy(p, l->data, l->len);
+    p[l->len] = '\0';
+    pool_free(pool, l->data, l->cap);
     l->data = p;
+    l->cap = cap;
 }
 
-static void line_insert_char(Line *l, size_t pos, char c) {
+static void line_insert_char(LinePool *pool, Line *l, size_t pos, char c) {
     if (pos > l->len) {
         pos = l->len;
     }
-    line_reserve(l, l->len+2);
+    line_reserve(pool, l, l->len+2);
     memmove(&l->data[pos+1], &l->data[pos], l->len - pos + 1);
     l->data[pos] = c;
     l->len++;
 }
 
-static void line_delete_char(Line *l, size_t pos) {
+static void line_delete_char(LinePool *pool, Line *l, size_t pos) {
     if (pos >= l->len) return;
 
+    line_reserve(pool, l, l->len+1);
     memmove(&l->data[pos], &l->data[pos+1], l->len - pos);
 
     l->len--;
 }
 
-static void line_append_bytes(Line *l, const char *s, size_t n) {
+static void line_append_bytes(LinePool *pool, Line *l, const char *s, size_t n) {
     if (!n) return;
-    line_reserve(l, l->len+n+1);
+    line_reserve(pool, l, l->len+n+1);
     memcpy(&l->data[l->len], s, n);
     l->len += n;
     l->data[l->len] = '\0';
 }
 
 static void buffer_free(Buffer *b) {
-    if (!b->lines) return;
-    for (size_t i = 0; i < b->line_count; i++) {
-        free(b->lines[i].data);
-        free(b->lines[i].hl); 
-    }
-    free(b->lines);
-    b->lines = NULL;
+    rope_node_free(b->root);
+    pool_release(&b->pool);
+    b->root = NULL;
     b->line_count = 0;
-    b->cap = 0;
+    b->cache_leaf = NULL;
+    b->cache_start = 0;
+
+    if (b->map) munmap((void *)b->map, b->map_len);
+    b->map = NULL;
+    b->map_len = 0;
+    b->map_scanned = 0;
 }
 
-static void buffer_append_line(Buffer *b, char **text, size_t len) {
-    if (b->line_count + 1 > b->cap) {
-        b->cap *= 2;
-	b->lines = realloc(b->lines, b->cap * sizeof(Line));
+// Copies every private line into pool, sized to its contents.
+static void rope_node_compact(RopeNode *node, LinePool *pool) {
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; i++) rope_node_compact(node->kids[i], pool);
+        return;
     }
 
-    Line *l = &b->lines[b->line_count];
-
-    l->cap = len + 1;
-    l->data = malloc(l->cap);
-    memcpy(l->data, *text, len);
-    l->data[len] = '\0';
-    l->len = len;
-
-    b->line_count++;
-}
+    for (int i = 0; node->lines && i < node->n; i++) {
+        Line *l = &node->lines[i];
 
-static void buffer_init(Buffer *b) {
-    b->cap = DEFAULT_BUF_CAP;
-    b->line_count = 1;
-    b->lines = calloc(b->cap, sizeof(Line));
-    if (!b->lines) die("calloc");
+        if (l->cap) {
+            char *p = pool_alloc(pool, l->len + 1, &l->cap);
+            memcpy(p, l->data, l->len);
+            p[l->len] = '\0';
+            l->data = p;
+        }
 
-    b->lines[0].cap = DEFAULT_LINE_CAP; // Start with one empty line
-    b->lines[0].data = calloc(b->lines[0].cap, 1);   // Zero out memory space for line
-    if (!b->lines[0].data) die("calloc");
-    b->lines[0].len = 0;
+        if (l->hl_cap) {
+            HlSpan *p = pool_alloc(pool, l->hl_n * sizeof(HlSpan), &l->hl_cap);
+            memcpy(p, l->hl_spans, l->hl_n * sizeof(HlSpan));
+            l->hl_spans = p;
+        }
+    }
 }
 
-static void buffer_ensure_line_capacity(Buffer *b, size_t needed_lines) {
-    if (needed_lines <= b->cap) return;
-    while (b->cap < needed_lines) b->cap *= 2;
-    Line *p = realloc(b->lines, b->cap * sizeof(Line));
-    if (!p) die("realloc");
-    memset(p + b->line_count, 0, (b->cap - b->line_count) * sizeof(Line));
-    b->lines = p;
+// Gives back the slack (cap - len) and the free blocks left behind
+// by bulk edits, by copying every line into a fresh, tightly packed
+// pool and dropping the old one.
+static void buffer_compact(Buffer *b) {
+    LinePool fresh = {0};
+    rope_node_compact(b->root, &fresh);
+    pool_release(&b->pool);
+    b->pool = fresh;
 }
 
-static void buffer_insert_line(Buffer *b, size_t row) {
+// Links an already built Line in at row; the rope takes ownership.
+static void buffer_insert_line_struct(Buffer *b, size_t row, const Line *l) {
     if (row > b->line_count) {
         row = b->line_count;
     }
+    if (row < b->line_count) {
+        b->hl_valid = MIN(b->hl_valid, row);
+        b->hl_version++;
+    }
+
+    RopeNode *right = rope_node_insert(b->root, row, l);
+    if (right) {
+        RopeNode *root = rope_node_new(false);
+        root->kids[0] = b->root;
+        root->kids[1] = right;
+        root->n = 2;
+        root->count = b->root->count + right->count;
+        b->root = root;
+    }
 
-    buffer_ensure_line_capacity(b, b->line_count + 1);
+    b->line_count++;
+    b->cache_leaf = NULL;
+}
 
-    memmove(&b->lines[row + 1], &b->lines[row], (b->line_count - row) * sizeof(Line));
+static void buffer_init(Buffer *b) {
+    b->root = rope_node_new(true);
+    b->line_count = 0;
+    b->cache_leaf = NULL;
+    b->cache_start = 0;
 
-    Line *l = &b->lines[row];
-    memset(l, 0, sizeof(*l));
-    l->cap = DEFAULT_LINE_CAP;
-    l->data = calloc(l->cap, 1);
-    if (!l->data) die("calloc");
-    l->len = 0;
+    Line l = line_new(&b->pool, "", 0); // Start with one empty line
+    buffer_insert_line_struct(b, 0, &l);
+}
 
-    b->line_count++;
+static void buffer_insert_line(Buffer *b, size_t row) {
+    Line l = line_new(&b->pool, "", 0);
+    buffer_insert_line_struct(b, row, &l);
 }
 
 static void buffer_delete_line(Buffer *b, size_t row) {
     if (b->line_count == 0 || row >= b->line_count) return;
 
-    if (b->line_count == 1) {
-        b->lines[0].len = 0;
-        b->lines[0].data[0] = '\0';
+    if (!buffer_has_line(b, 1)) {
+        Line *l = buffer_line(b, 0);
+        line_reserve(&b->pool, l, 1);
+        l->len = 0;
+        l->data[0] = '\0';
+        buffer_line_changed(b, 0);
         return;
     }
 
-    free(b->lines[row].data);
-    free(b->lines[row].hl);
-    memmove(&b->lines[row], &b->lines[row + 1], (b->line_count - row - 1) * sizeof(Line));
+    Line gone;
+    rope_node_delete(b->root, row, &gone);
+    b->hl_valid = MIN(b->hl_valid, row);
+    b->hl_version++;
+    line_width_forget(&gone);
+    pool_free(&b->pool, gone.data, gone.cap);
+    if (gone.hl_cap) pool_free(&b->pool, gone.hl_spans, gone.hl_cap);
+
+    // Collapse single-child roots so lookups don't pay for empty levels
+    while (!b->root->leaf && b->root->n == 1) {
+        RopeNode *old = b->root;
+        b->root = old->kids[0];
+        rope_node_release(old);
+    }
+
     b->line_count--;
+    b->cache_leaf = NULL;
 }
 
 static void buffer_split_line(Buffer *b, Cursor *c) {
     if (c->row >= b->line_count) return;
 
-    Line *cur = &b->lines[c->row];
+    Line *cur = buffer_line(b, c->row);
     c->col = MIN(c->col, cur->len);
 
     buffer_insert_line(b, c->row + 1);
-    Line *next = &b->lines[c->row + 1];
+    cur = buffer_line(b, c->row); // May have moved if its leaf split
+    Line *next = buffer_line(b, c->row + 1);
 
     size_t tail_len = cur->len - c->col;
-    line_reserve(next, tail_len + 1);
+    line_reserve(&b->pool, next, tail_len + 1);
 
     memcpy(next->data, &cur->data[c->col], tail_len);
     next->data[tail_len] = '\0';
     next->len = tail_len;
 
+    line_reserve(&b->pool, cur, cur->len + 1);
     cur->len = c->col;
     cur->data[cur->len] = '\0';
+    buffer_line_changed(b, c->row);
+    buffer_line_changed(b, c->row + 1);
 
     c->row++;
     c->col = 0;
@@ -396,62 +1352,355 @@ static void buffer_split_line(Buffer *b, Cursor *c) {
 static void buffer_join_line_with_prev(Buffer *b, Cursor *c) {
     if (c->row == 0 || c->row >= b->line_count) return;
 
-    Line *prev = &b->lines[c->row - 1];
-    Line *cur = &b->lines[c->row];
+    Line *prev = buffer_line(b, c->row - 1);
+    Line *cur = buffer_line(b, c->row);
 
     size_t prev_len = prev->len;
-    line_append_bytes(prev, cur->data, cur->len);
+    line_append_bytes(&b->pool, prev, cur->data, cur->len);
+    buffer_line_changed(b, c->row - 1);
 
     buffer_delete_line(b, c->row);
     c->row--;
     c->col = prev_len;
 }
 
-static void buffer_append_line_owned(Buffer *b, const char *text, size_t len) {
-    buffer_ensure_line_capacity(b, b->line_count+1);
+// Splices text, which may span several lines, in at the cursor
+// and leaves the cursor just after it.
+static void buffer_insert_text(Buffer *b, Cursor *c, const char *s, size_t n) {
+    if (c->row >= b->line_count || n == 0) return;
+
+    Line *cur = buffer_line(b, c->row);
+    c->col = MIN(c->col, cur->len);
 
-    Line *l = &b->lines[b->line_count];
-    memset(l, 0, sizeof(*l));
+    const char *nl = memchr(s, '\n', n);
+    if (!nl) {
+        line_reserve(&b->pool, cur, cur->len + n + 1);
+        memmove(&cur->data[c->col + n], &cur->data[c->col], cur->len - c->col);
+        memcpy(&cur->data[c->col], s, n);
+        cur->len += n;
+        cur->data[cur->len] = '\0';
+        buffer_line_changed(b, c->row);
+        c->col += n;
+        return;
+    }
 
-    l->cap = MAX(DEFAULT_LINE_CAP, len+1);
-    l->data = malloc(l->cap);
-    if (!l->data) die("malloc");
-    if (len) memcpy(l->data, text, len);
-    l->data[len] = '\0';
-    l->len = len;
+    // The text after the cursor ends up behind the last new line
+    const char *last = s + n;
+    while (last[-1] != '\n') last--;
+    size_t last_len = (size_t)(s + n - last);
+    Line tail = line_new(&b->pool, last, last_len);
+    line_append_bytes(&b->pool, &tail, &cur->data[c->col], cur->len - c->col);
 
-    b->line_count++;
+    cur->len = c->col;
+    line_append_bytes(&b->pool, cur, s, (size_t)(nl - s));
+    buffer_line_changed(b, c->row);
+
+    size_t row = c->row;
+    const char *p = nl + 1;
+    while (p < last) {
+        const char *e = memchr(p, '\n', (size_t)(last - p));
+        Line l = line_new(&b->pool, p, (size_t)(e - p));
+        buffer_insert_line_struct(b, ++row, &l);
+        p = e + 1;
+    }
+    buffer_insert_line_struct(b, ++row, &tail);
+
+    c->row = row;
+    c->col = last_len;
 }
 
-int buffer_load_file(Buffer *b, FILE *fp) {
-    buffer_free(b);
+// Takes out n bytes of text starting at (row, col), joining lines
+// for the newlines among them. Whole lines in between are dropped
+// one by one, so it costs about as much as the text it removes.
+static void buffer_delete_text(Buffer *b, size_t row, size_t col, size_t n) {
+    if (row >= b->line_count || n == 0) return;
+
+    Line *cur = buffer_line(b, row);
+    col = MIN(col, cur->len);
+    if (n <= cur->len - col) {
+        line_reserve(&b->pool, cur, cur->len + 1);
+        memmove(&cur->data[col], &cur->data[col + n], cur->len - col - n);
+        cur->len -= n;
+        cur->data[cur->len] = '\0';
+        buffer_line_changed(b, row);
+        return;
+    }
 
-    b->cap = DEFAULT_BUF_CAP;
-    b->line_count = 0;
-    b->lines = calloc(b->cap, sizeof(Line));
-    if (!b->lines) die("calloc");
+    // Find the line the text ends in, and how far into it
+    size_t left = n - (cur->len - col);
+    size_t last = row;
+    while (last + 1 < b->line_count) {
+        left--;     // The newline ending line last
+        last++;
+        size_t len = buffer_line(b, last)->len;
+        if (left <= len) break;
+        left -= len;
+    }
 
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t n;
+    Line *tail = buffer_line(b, last);
+    size_t skip = MIN(left, tail->len);
+    cur = buffer_line(b, row);
+    cur->len = col;
+    line_reserve(&b->pool, cur, col + 1);
+    cur->data[col] = '\0';
+    if (last > row) line_append_bytes(&b->pool, cur, &tail->data[skip], tail->len - skip);
+    buffer_line_changed(b, row);
 
-    while ((n = getline(&line, &cap, fp)) != -1) {
-        if (n > 0 && line[n-1] == '\n') {
-	        n--;
-	    }
+    for (size_t k = row; k < last; k++) buffer_delete_line(b, row + 1);
+}
+
+static void buffer_append_line_owned(Buffer *b, const char *text, size_t len) {
+    Line l = line_new(&b->pool, text, len);
+    buffer_insert_line_struct(b, b->line_count, &l);
+}
+
+// Large regular files are mapped instead of read. Their lines stay
+// views into the mapping, and only enough of the file for the first
+// screen is indexed up front; the rest is indexed on demand or while
+// the editor sits idle waiting for input.
+static bool buffer_map_file(Buffer *b, FILE *fp) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1) return false;
+    if (!S_ISREG(st.st_mode) || st.st_size < MMAP_LOAD_MIN) return false;
+
+    void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (m == MAP_FAILED) return false;
+
+    b->map = m;
+    b->map_len = (size_t)st.st_size;
+    b->map_scanned = 0;
 
-	    buffer_append_line_owned(b, line, (size_t)n);
+    buffer_index_step(b, INDEX_STEP);
+    return true;
+}
+
+static void buffer_push_owned_line(Buffer *b, RopeNode **leaf, const char *text, size_t len) {
+    if (!*leaf) *leaf = rope_node_new(true);
+
+    (*leaf)->lines[(*leaf)->n++] = line_new(&b->pool, text, len);
+    (*leaf)->count++;
+
+    if ((*leaf)->n == ROPE_LEAF_MAX) {
+        buffer_push_leaf(b, *leaf);
+        *leaf = NULL;
     }
-    free(line);
+}
+
+// Reads the file READ_BLOCK bytes at a time, indexes the newlines
+// of each block and builds full leaves of private lines straight
+// from the index. A line cut off at the end of a block is carried
+// over to the front of the next one.
+static int buffer_read_file(Buffer *b, FILE *fp) {
+    int fd = fileno(fp);
+    size_t cap = READ_BLOCK * 2;
+    char *text = malloc(cap);
+    if (!text) die("malloc");
+
+    RopeNode *leaf = NULL;
+    size_t len = 0; // Carried-over bytes plus the block just read
+    bool eof = false;
+    while (!eof) {
+        if (cap - len < READ_BLOCK) {
+            cap *= 2;
+            char *p = realloc(text, cap);
+            if (!p) die("realloc");
+            text = p;
+        }
+        ssize_t n = read(fd, text + len, READ_BLOCK);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            free(text);
+            if (leaf) buffer_push_leaf(b, leaf);
+            return -1;
+        }
+        eof = (n == 0);
+        len += (size_t)n;
+
+        LineIndex idx;
+        line_index_build(&idx, text, 0, len);
+
+        size_t line_start = 0;
+        for (int t = 0; t < idx.n; t++) {
+            const IndexChunk *c = &idx.chunks[t];
+            for (size_t k = 0; k < c->count; k++) {
+                buffer_push_owned_line(b, &leaf, text + line_start, c->nl[k] - line_start);
+                line_start = c->nl[k] + 1;
+            }
+        }
+        line_index_free(&idx);
+
+        if (eof && line_start < len) {
+            buffer_push_owned_line(b, &leaf, text + line_start, len - line_start);
+            line_start = len;
+        }
+        memmove(text, text + line_start, len - line_start);
+        len -= line_start;
+    }
+    if (leaf) buffer_push_leaf(b, leaf);
+
+    free(text);
+    return 0;
+}
+
+int buffer_load_file(Buffer *b, FILE *fp) {
+    buffer_free(b);
+    b->root = rope_node_new(true);
+
+    int ret = 0;
+    if (!buffer_map_file(b, fp)) ret = buffer_read_file(b, fp);
     fclose(fp);
 
     if (b->line_count == 0) {
         buffer_append_line_owned(b, "", 0);
     }
 
+    return ret;
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// mpad --bench-load <file>: times a full eager load of the file
+// through both load paths and reports the throughput.
+static int bench_load(const char *path) {
+    const char *names[] = { "read", "map+index" };
+
+    for (int mode = 0; mode < 2; mode++) {
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            perror(path);
+            return 1;
+        }
+
+        Buffer b = {0};
+        b.root = rope_node_new(true);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t bytes = 0;
+        if (mode == 0) {
+            buffer_read_file(&b, fp);
+            struct stat st;
+            if (fstat(fileno(fp), &st) == 0) bytes = (size_t)st.st_size;
+        } else if (buffer_map_file(&b, fp)) {
+            buffer_index_all(&b);
+            bytes = b.map_len;
+        }
+        double secs = elapsed_since(&start);
+        fclose(fp);
+
+        if (bytes == 0 && mode == 1) {
+            printf("%-10s skipped (file too small to map)\n", names[mode]);
+        } else {
+            printf("%-10s %zu lines, %.3f GB in %.3f s: %.2f GB/s\n",
+                   names[mode], b.line_count, (double)bytes / 1e9, secs,
+                   secs > 0 ? (double)bytes / 1e9 / secs : 0.0);
+        }
+        buffer_free(&b);
+    }
+    return 0;
+}
+
+/* ----- saving ------ */
+
+// Gathers the buffer into iovecs and hands them to writev in
+// batches. Pieces that sit back to back in memory (untouched text
+// of a mapped file) are merged into one iovec.
+typedef struct {
+    int fd;
+    struct iovec iov[SAVE_IOV_BATCH];
+    int n;
+    size_t bytes;
+    bool any;           // Has a line been emitted yet?
+    const char *map;    // Mapping newlines can be reused as separators
+    size_t map_len;
+} SaveWriter;
+
+static int save_flush(SaveWriter *w) {
+    struct iovec *iov = w->iov;
+    int n = w->n;
+    while (n > 0) {
+        ssize_t wrote = writev(w->fd, iov, n);
+        if (wrote == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        w->bytes += (size_t)wrote;
+
+        // Step past whatever a short write did get out
+        size_t left = (size_t)wrote;
+        while (n > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    w->n = 0;
+    return 0;
+}
+
+static int save_emit(SaveWriter *w, const char *p, size_t len) {
+    if (len == 0) return 0;
+
+    if (w->n > 0) {
+        struct iovec *last = &w->iov[w->n - 1];
+        if ((const char *)last->iov_base + last->iov_len == p && last->iov_len + len <= SAVE_IOV_MAX_LEN) {
+            last->iov_len += len;
+            return 0;
+        }
+    }
+
+    if (w->n == SAVE_IOV_BATCH && save_flush(w) == -1) return -1;
+    w->iov[w->n].iov_base = (void *)p;
+    w->iov[w->n].iov_len = len;
+    w->n++;
     return 0;
 }
 
+// Emits text holding one or more whole lines, separated from what
+// came before by a newline. Lines are joined, not terminated, by
+// '\n', so a trailing newline in text is dropped.
+static int save_emit_lines(SaveWriter *w, const char *text, size_t len, bool nl_terminated) {
+    if (w->any) {
+        const char *prev = w->n ? (const char *)w->iov[w->n - 1].iov_base + w->iov[w->n - 1].iov_len : NULL;
+        bool mapped_nl = prev && w->map && prev >= w->map && prev < w->map + w->map_len && *prev == '\n';
+        if (save_emit(w, mapped_nl ? prev : "\n", 1) == -1) return -1;
+    }
+    w->any = true;
+    return save_emit(w, text, nl_terminated ? len - 1 : len);
+}
+
+static int save_node(SaveWriter *w, const RopeNode *node) {
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; i++) {
+            if (save_node(w, node->kids[i]) == -1) return -1;
+        }
+        return 0;
+    }
+
+    if (!node->lines) {
+        // Never visited: write the span straight from the mapping
+        if (node->n == 0) return 0;
+        return save_emit_lines(w, node->span, node->span_len, node->span[node->span_len - 1] == '\n');
+    }
+
+    for (int i = 0; i < node->n; i++) {
+        if (save_emit_lines(w, node->lines[i].data, node->lines[i].len, false) == -1) return -1;
+    }
+    return 0;
+}
+
+// Writes the buffer to a temp file next to path, syncs it and renames
+// it over path, so a crash or a full disk mid-save leaves the old file
+// intact. The old file's mode is kept. Since the old inode survives
+// the rename, a mapping of it stays valid.
 int dump_buffer_to_file(Buffer *b, const char *path) {
 
     if (!path || !*path) {
@@ -459,39 +1708,582 @@ int dump_buffer_to_file(Buffer *b, const char *path) {
         return 1;
     }
 
-    FILE *fp = fopen(path, "w");	
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if (!fp) {
+    // Write through symlinks rather than replacing them
+    char *real = realpath(path, NULL);
+    const char *target = real ? real : path;
+
+    const char *slash = strrchr(target, '/');
+    size_t dir_len = slash ? (size_t)(slash - target) + 1 : 0;
+    char *tmp = malloc(strlen(target) + 16);
+    if (!tmp) die("malloc");
+    sprintf(tmp, "%.*s.%s.XXXXXX", (int)dir_len, target, target + dir_len);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
         snprintf(global_status, sizeof(global_status), "Write failed: %s", strerror(errno));
+        free(tmp);
+        free(real);
         return 1;
     }
-	
-    for (size_t i = 0; i < b->line_count; i++) {
-        if (b->lines[i].len > 0) {
 
-            size_t wrote = fwrite(b->lines[i].data, 1, b->lines[i].len, fp);
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+
+    SaveWriter w = {0};
+    w.fd = fd;
+    w.map = b->map;
+    w.map_len = b->map_len;
+
+    int err = save_node(&w, b->root);
+    if (err == 0 && buffer_indexing(b)) {
+        // Lines past the indexed part go out as one raw block
+        const char *tail = b->map + b->map_scanned;
+        size_t tail_len = b->map_len - b->map_scanned;
+        err = save_emit_lines(&w, tail, tail_len, tail[tail_len - 1] == '\n');
+    }
+    if (err == 0) err = save_flush(&w);
+    if (err == 0) err = fsync(fd);
+    int saved_errno = errno;
+    if (close(fd) == -1 && err == 0) {
+        err = -1;
+        saved_errno = errno;
+    }
+    if (err == 0 && rename(tmp, target) == -1) {
+        err = -1;
+        saved_errno = errno;
+    }
+
+    if (err != 0) {
+        unlink(tmp);
+        snprintf(global_status, sizeof(global_status), "Write failed: %s", strerror(saved_errno));
+        free(tmp);
+        free(real);
+        return 1;
+    }
+
+    // Make the rename itself durable
+    char *dir = strndup(target, dir_len ? dir_len : 1);
+    if (!dir) die("strndup");
+    int dfd = open(dir_len ? dir : ".", O_RDONLY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(dir);
+    free(tmp);
+    free(real);
 
-            if (wrote != b->lines[i].len) {
-                snprintf(global_status, sizeof(global_status), "Write failed: %s", strerror(errno));
-                fclose(fp);
-                return 1;
+    global_dirty = false;
+    snprintf(global_status, sizeof(global_status), "Wrote %s (%zu bytes, %.1f ms)",
+             path, w.bytes, elapsed_since(&start) * 1e3);
+    return 0;
+}
+
+/* ----- crash journal ------ */
+
+// Every edit is also appended to a journal next to the file
+// (.name.mpj), so after a crash 'mpad -r name' can replay them onto
+// the file as it was last saved. The editor only copies records
+// into memory. A thread writes them out once JOURNAL_SYNC_MS has
+// passed since the first of them, so one fsync covers every edit
+// made in that window and typing never waits on the disk.
+
+#define JOURNAL_MAGIC "mpadjnl1"
+
+// The journal starts with the size and mtime of the file its
+// records apply to; each record is an UndoOp and its text
+typedef struct {
+    char magic[8];
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} JournalHeader;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool on;                // Is this session journaled?
+    char *path;
+    int fd;
+    pthread_t thread;
+    bool running;
+
+    char *pending;          // Records the thread hasn't taken yet
+    size_t pending_len, pending_cap;
+    uint64_t appended;      // Record bytes appended since the journal began
+    uint64_t base;          // Where in those the file's first record is
+
+    // A save finished: start over from compact_mark against compact_file
+    bool compact;
+    uint64_t compact_mark;
+    char *compact_file;
+
+    bool quit;
+    unsigned long syncs;
+    int error;              // errno of a write that failed; nothing is journaled after it
+    bool reported;          // The editor has said so
+} Journal;
+
+static Journal journal = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .fd = -1 };
+
+// dir/.name.mpj for dir/name
+static char *journal_path_for(const char *file) {
+    const char *slash = strrchr(file, '/');
+    size_t dir = slash ? (size_t)(slash - file + 1) : 0;
+    size_t len = strlen(file);
+    char *path = malloc(len + 6);
+    if (!path) die("malloc");
+    memcpy(path, file, dir);
+    path[dir] = '.';
+    memcpy(path + dir + 1, file + dir, len - dir);
+    memcpy(path + len + 1, ".mpj", 5);
+    return path;
+}
+
+// What the journal for file has to start with. A file that doesn't
+// exist yet is all zeroes.
+static JournalHeader journal_header_for(const char *file) {
+    JournalHeader h = {0};
+    memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+    struct stat st;
+    if (stat(file, &st) == 0) {
+        h.size = (int64_t)st.st_size;
+        h.mtime_sec = (int64_t)st.st_mtim.tv_sec;
+        h.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    }
+    return h;
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Starts the journal over for the file a save just wrote: the
+// records from mark on, made while the save ran, are copied into a
+// fresh journal, which then replaces the old one with a rename.
+// Runs on the journal thread, which has written everything up to
+// written already.
+static void journal_rewrite(Journal *j, const char *file, uint64_t mark, uint64_t written) {
+    // Records the save covers never made it to the journal
+    if (written < mark) return;
+
+    char *path = journal_path_for(file);
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp = malloc(tmp_len);
+    if (!tmp) die("malloc");
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+
+    size_t keep = (size_t)(written - mark);
+    char *tail = malloc(MAX(keep, 1));
+    if (!tail) die("malloc");
+    bool ok = pread(j->fd, tail, keep, (off_t)(sizeof(JournalHeader) + (mark - j->base))) == (ssize_t)keep;
+
+    JournalHeader h = journal_header_for(file);
+    int fd = ok ? open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600) : -1;
+    ok = fd != -1 &&
+         write_all(fd, (const char *)&h, sizeof(h)) == 0 &&
+         write_all(fd, tail, keep) == 0 &&
+         fdatasync(fd) == 0 &&
+         rename(tmp, path) == 0;
+    free(tail);
+    free(tmp);
+    if (!ok) {
+        // Keep the old one; it still replays onto the old file
+        if (fd != -1) close(fd);
+        free(path);
+        return;
+    }
+
+    if (strcmp(path, j->path) != 0) unlink(j->path);
+    pthread_mutex_lock(&j->lock);
+    close(j->fd);
+    j->fd = fd;
+    free(j->path);
+    j->path = path;
+    j->base = mark;
+    pthread_mutex_unlock(&j->lock);
+}
+
+// A write to the journal failed after the first good bytes of
+// records: cuts off whatever part of a record got out, so the journal
+// still replays up to there, and stops journaling.
+static void journal_fail(Journal *j, uint64_t good) {
+    int error = errno;
+    if (ftruncate(j->fd, (off_t)(sizeof(JournalHeader) + (good - j->base))) == 0) lseek(j->fd, 0, SEEK_END);
+    pthread_mutex_lock(&j->lock);
+    j->error = error;
+    pthread_mutex_unlock(&j->lock);
+}
+
+static void *journal_main(void *arg) {
+    Journal *j = arg;
+    char *out = NULL;
+    size_t out_cap = 0;
+    uint64_t written;
+
+    pthread_mutex_lock(&j->lock);
+    written = j->appended;
+    for (;;) {
+        while (!j->quit && !j->compact && j->pending_len == 0) pthread_cond_wait(&j->wake, &j->lock);
+
+        // Give the rest of the window's edits a chance to come in
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += JOURNAL_SYNC_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        while (!j->quit && !j->compact && j->pending_len < JOURNAL_FLUSH_BYTES) {
+            if (pthread_cond_timedwait(&j->wake, &j->lock, &until) == ETIMEDOUT) break;
+        }
+
+        // Swap buffers, so the editor carries on into an empty one
+        char *buf = j->pending;
+        size_t len = j->pending_len;
+        size_t cap = j->pending_cap;
+        j->pending = out;
+        j->pending_cap = out_cap;
+        j->pending_len = 0;
+        out = buf;
+        out_cap = cap;
+
+        bool quit = j->quit;
+        bool compact = j->compact;
+        uint64_t mark = j->compact_mark;
+        char *file = j->compact_file;
+        j->compact = false;
+        j->compact_file = NULL;
+        int fd = j->fd;
+        bool failed = (j->error != 0);
+        pthread_mutex_unlock(&j->lock);
+
+        bool wrote = false;
+        if (len > 0 && !failed) {
+            wrote = (write_all(fd, out, len) == 0);
+            if (wrote) {
+                written += len;
+            } else {
+                journal_fail(j, written);
+                failed = true;
             }
         }
-        
-        if (i + 1 < b->line_count) {
-            fputc('\n', fp);
+        bool synced = wrote && fdatasync(fd) == 0;
+        if (compact && !failed) journal_rewrite(j, file, mark, written);
+        free(file);
+        if (quit) break;
+        pthread_mutex_lock(&j->lock);
+        if (synced) j->syncs++;
+    }
+    free(out);
+    return NULL;
+}
+
+// Adds an edit to the journal. Only copies it; the thread does the rest.
+static void journal_append(enum UndoKind kind, size_t row, size_t col, const char *s, size_t n) {
+    Journal *j = &journal;
+    if (!j->on) return;
+
+    // Zeroed so no stray padding bytes end up on disk
+    UndoOp op;
+    memset(&op, 0, sizeof(op));
+    op.row = row;
+    op.col = col;
+    op.len = n;
+    op.kind = (unsigned char)kind;
+
+    pthread_mutex_lock(&j->lock);
+    if (j->error) {
+        int error = j->error;
+        pthread_mutex_unlock(&j->lock);
+        if (!j->reported) {
+            snprintf(global_status, sizeof(global_status), "Journal write failed (%s); edits aren't journaled any more", strerror(error));
+            j->reported = true;
         }
+        return;
     }
+    size_t need = j->pending_len + sizeof(op) + n;
+    if (need > j->pending_cap) {
+        size_t cap = j->pending_cap ? j->pending_cap : 4096;
+        while (cap < need) cap *= 2;
+        j->pending = realloc(j->pending, cap);
+        if (!j->pending) die("realloc");
+        j->pending_cap = cap;
+    }
+    bool was_empty = (j->pending_len == 0);
+    memcpy(j->pending + j->pending_len, &op, sizeof(op));
+    memcpy(j->pending + j->pending_len + sizeof(op), s, n);
+    j->pending_len = need;
+    j->appended += sizeof(op) + n;
+    if (was_empty || j->pending_len >= JOURNAL_FLUSH_BYTES) pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+
+    // Without the thread, at least get it to the kernel
+    if (!j->running) {
+        if (write_all(j->fd, j->pending, j->pending_len) == -1) journal_fail(j, j->appended - j->pending_len);
+        j->pending_len = 0;
+    }
+}
 
-    fclose(fp);
-    global_dirty = false;
-    snprintf(global_status, sizeof(global_status), "Wrote %s", path);
-    return 0;
+// Replays the records in buf onto b. Returns how many applied; a
+// torn or nonsensical record ends it, and *used says where.
+static size_t journal_replay(Buffer *b, const char *buf, size_t len, size_t *used) {
+    size_t off = 0, count = 0;
+    while (len - off >= sizeof(UndoOp)) {
+        UndoOp op;
+        memcpy(&op, buf + off, sizeof(op));
+        if (op.len > len - off - sizeof(op) || op.kind > UNDO_DELETE) break;
+
+        // Saving drops a trailing empty line, which loading then
+        // doesn't bring back
+        if (op.row == b->line_count && !buffer_has_line(b, op.row)) buffer_insert_line(b, op.row);
+        if (!buffer_has_line(b, op.row) || op.col > buffer_line(b, op.row)->len) break;
+
+        const char *text = buf + off + sizeof(op);
+        if (op.kind == UNDO_INSERT) {
+            Cursor c = { op.row, op.col };
+            buffer_insert_text(b, &c, text, op.len);
+        } else {
+            buffer_delete_text(b, op.row, op.col, op.len);
+        }
+        off += sizeof(op) + op.len;
+        count++;
+    }
+    *used = off;
+    return count;
+}
+
+// Sets up the journal for file, which has just been loaded into b.
+// With recover, the edits in an existing journal are replayed first
+// and it's carried on; otherwise one that's there is left alone, and
+// this session isn't journaled.
+static void journal_open(Buffer *b, const char *file, bool recover) {
+    Journal *j = &journal;
+    char *path = journal_path_for(file);
+    JournalHeader want = journal_header_for(file);
+
+    if (!recover) {
+        int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            if (errno == EEXIST) {
+                snprintf(global_status, sizeof(global_status), "%s has unsaved edits; 'mpad -r %s' recovers them", path, file);
+            }
+            free(path);
+            return;
+        }
+        if (write_all(fd, (const char *)&want, sizeof(want)) == -1) {
+            close(fd);
+            unlink(path);
+            free(path);
+            return;
+        }
+        j->fd = fd;
+        j->path = path;
+        j->on = true;
+        return;
+    }
+
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    JournalHeader h;
+    if (fd == -1 || fstat(fd, &st) == -1 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0) {
+        snprintf(global_status, sizeof(global_status), "No journal to recover for %s", file);
+        if (fd != -1) close(fd);
+        free(path);
+        return;
+    }
+    if (h.size != want.size || h.mtime_sec != want.mtime_sec || h.mtime_nsec != want.mtime_nsec) {
+        snprintf(global_status, sizeof(global_status), "%s changed since its journal was written; not recovered", file);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    size_t len = (size_t)st.st_size - sizeof(h);
+    char *buf = malloc(MAX(len, 1));
+    if (!buf) die("malloc");
+    if (pread(fd, buf, len, sizeof(h)) != (ssize_t)len) len = 0;
+    size_t used;
+    size_t count = journal_replay(b, buf, len, &used);
+    free(buf);
+
+    // Cut off a record torn by the crash, so new ones follow whole ones
+    if (ftruncate(fd, (off_t)(sizeof(h) + used)) == -1 || lseek(fd, 0, SEEK_END) == -1) {
+        close(fd);
+        free(path);
+        return;
+    }
+    j->fd = fd;
+    j->path = path;
+    j->on = true;
+    j->appended = used;
+    if (count > 0) global_dirty = true;
+    snprintf(global_status, sizeof(global_status), "Recovered %zu edits from %s", count, path);
+}
+
+// Starts the writer thread, once the editor is far enough along to
+// have its signals set up.
+static void journal_start(void) {
+    Journal *j = &journal;
+    if (!j->on) return;
+
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    j->running = (pthread_create(&j->thread, NULL, journal_main, j) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// A save of the buffer as it was at journal offset mark went to
+// file, so the records before mark aren't needed any more.
+static void journal_saved(const char *file, uint64_t mark) {
+    Journal *j = &journal;
+    if (!j->on || !j->running) return;
+
+    char *copy = strdup(file);
+    if (!copy) die("strdup");
+    pthread_mutex_lock(&j->lock);
+    free(j->compact_file);
+    j->compact = true;
+    j->compact_mark = mark;
+    j->compact_file = copy;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+}
+
+static unsigned long journal_syncs(void) {
+    pthread_mutex_lock(&journal.lock);
+    unsigned long n = journal.syncs;
+    pthread_mutex_unlock(&journal.lock);
+    return n;
+}
+
+// On the way out of a session that ended normally, whether the edits
+// were saved or thrown away, the journal goes too.
+static void journal_close(void) {
+    Journal *j = &journal;
+    if (!j->on) return;
+
+    if (j->running) {
+        pthread_mutex_lock(&j->lock);
+        j->quit = true;
+        pthread_cond_signal(&j->wake);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->thread, NULL);
+    }
+    close(j->fd);
+    unlink(j->path);
+    free(j->path);
+    free(j->pending);
+    free(j->compact_file);
+    j->on = false;
+}
+
+/* ----- background saves ------ */
+
+// Saves run in a forked child, which writes from its copy-on-write
+// snapshot of the buffer while the editor keeps going. The child's
+// status line comes back through a pipe. Returns false if no save
+// was started, or the synchronous fallback failed.
+static bool editor_save_in_background(const char *path) {
+    if (!path || !*path) {
+        snprintf(global_status, sizeof(global_status), "No file name (use :w <path>)");
+        return false;
+    }
+    if (save_pid != -1) {
+        snprintf(global_status, sizeof(global_status), "Still writing, try again in a moment");
+        return false;
+    }
+
+    int fds[2];
+    if (pipe(fds) == -1) {
+        if (dump_buffer_to_file(&global_buffer, path) != 0) return false;
+        journal_saved(path, journal.appended);
+        return true;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        if (dump_buffer_to_file(&global_buffer, path) != 0) return false;
+        journal_saved(path, journal.appended);
+        return true;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        int ret = dump_buffer_to_file(&global_buffer, path);
+        // Without the message the parent still has the exit status
+        (void)write_all(fds[1], global_status, strlen(global_status));
+        _exit(ret);
+    }
+
+    close(fds[1]);
+    save_pid = pid;
+    save_pipe = fds[0];
+    save_edit_seq = global_edit_seq;
+    save_journal_mark = journal.appended;
+    free(save_path);
+    save_path = strdup(path);
+    if (!save_path) die("strdup");
+    snprintf(global_status, sizeof(global_status), "Writing %s...", path);
+    return true;
+}
+
+// Reaps a finished background save. Returns true if one finished.
+static bool editor_poll_save(bool block) {
+    if (save_pid == -1) return false;
+
+    int wstatus;
+    pid_t r;
+    do {
+        r = waitpid(save_pid, &wstatus, block ? 0 : WNOHANG);
+    } while (r == -1 && errno == EINTR);
+    if (r == 0) return false;
+
+    char msg[sizeof(global_status)];
+    ssize_t n = read(save_pipe, msg, sizeof(msg) - 1);
+    close(save_pipe);
+    save_pipe = -1;
+    save_pid = -1;
+
+    bool ok = (r != -1 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0);
+    if (n > 0) {
+        msg[n] = '\0';
+        snprintf(global_status, sizeof(global_status), "%s", msg);
+    } else if (!ok) {
+        snprintf(global_status, sizeof(global_status), "Write failed");
+    }
+
+    // Edits made while the file was being written are still unsaved
+    if (ok && global_edit_seq == save_edit_seq) global_dirty = false;
+    if (ok) journal_saved(save_path, save_journal_mark);
+    return true;
 }
 
 /* ----- raw mode funcs ------ */
 
 void disable_raw_mode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
 }
 
@@ -506,43 +2298,252 @@ void enable_raw_mode() {
     raw.c_oflag &= (tcflag_t)~(OPOST);
     raw.c_cflag |= (tcflag_t)(CS8);
 
+    // Reads never block; editor_wait() does the waiting
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    // Have pastes arrive wrapped in ESC[200~ ... ESC[201~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/* ----- event loop ------ */
+
+enum EditorEvent {
+    EV_TIMEOUT = 0,
+    EV_INPUT = 1 << 0,      // Terminal input is waiting
+    EV_RESIZE = 1 << 1,     // The window size changed
+    EV_SAVE = 1 << 2,       // A background save finished
+    EV_HIGHLIGHT = 1 << 3   // The highlighting thread finished a job
+};
+
+// Highlighting lives further down
+static bool editor_syntax_pending(void);
+static bool editor_syntax_advance(size_t max, size_t from, size_t to);
+static void editor_hl_dispatch(void);
+static bool editor_hl_collect(void);
+
+static void handle_sigwinch(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    write(winch_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+static void editor_update_window_size(void) {
+    int rows, cols;
+    if (get_window_size(&rows, &cols) == 0) {
+        global_rows = rows;
+        global_cols = cols;
+    }
+}
+
+static void editor_init_events(void) {
+    editor_update_window_size();
+
+    if (pipe(winch_pipe) == -1) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(winch_pipe[i], F_SETFL, fcntl(winch_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(winch_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigwinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+// The one place the editor sleeps: blocks until input arrives, the
+// window is resized, background work finishes or timeout_ms passes
+// (-1 waits forever). Returns the EV_* bits that happened.
+static int editor_wait(int timeout_ms) {
+    struct pollfd fds[4];
+    int nfds = 0;
+    fds[nfds++] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+    fds[nfds++] = (struct pollfd){ .fd = winch_pipe[0], .events = POLLIN };
+    fds[nfds++] = (struct pollfd){ .fd = hl_pipe[0], .events = POLLIN };
+    if (save_pipe != -1) fds[nfds++] = (struct pollfd){ .fd = save_pipe, .events = POLLIN };
+
+    int r = poll(fds, (nfds_t)nfds, timeout_ms);
+    if (r == -1 && errno != EINTR) die("poll");
+    if (r <= 0) return EV_TIMEOUT;
+
+    int ev = 0;
+    if (fds[0].revents) ev |= EV_INPUT;
+    if (fds[1].revents) {
+        char drain[64];
+        while (read(winch_pipe[0], drain, sizeof(drain)) > 0) {}
+        editor_update_window_size();
+        ev |= EV_RESIZE;
+    }
+    if (fds[2].revents) {
+        char drain[64];
+        while (read(hl_pipe[0], drain, sizeof(drain)) > 0) {}
+        if (editor_hl_collect()) frame_pending = true;
+        ev |= EV_HIGHLIGHT;
+    }
+    // The child writes its status right before exiting, so this
+    // only waits a moment
+    if (nfds > 3 && fds[3].revents && editor_poll_save(true)) ev |= EV_SAVE;
+    return ev;
+}
+
+static bool input_pending(void) {
+    if (input_head != input_tail) return true;
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Should the owed frame be drawn now? Not while more keys are
+// already queued (up to TYPEAHEAD_MAX_MS), nor sooner than the
+// frame interval allows.
+static bool editor_frame_due(void) {
+    if (!frame_pending) return false;
+    double since_ms = elapsed_since(&last_frame_time) * 1000.0;
+    if (since_ms < TYPEAHEAD_MAX_MS && input_pending()) return false;
+    return since_ms >= global_frame_ms;
+}
+
+// How long editor_wait() may sleep before a frame is owed; -1 if none is
+static int editor_frame_timeout(void) {
+    if (!frame_pending) return -1;
+    double left = global_frame_ms - elapsed_since(&last_frame_time) * 1000.0;
+    return left > 0 ? (int)left + 1 : 0;
+}
+
+// Background chores that run whenever no input is waiting
+static bool editor_idle_work_pending(void) {
+    return buffer_indexing(&global_buffer) || (editor_syntax_pending() && !hl_in_flight) ||
+           global_buffer.pool.free_bytes > POOL_COMPACT_MIN;
+}
+
+static void editor_do_idle_work(void) {
+    // Keep indexing a mapped file, catch highlighting up with the
+    // edits, and tidy up line storage after big edits
+    if (buffer_indexing(&global_buffer)) {
+        buffer_index_step(&global_buffer, INDEX_STEP);
+    } else if (editor_syntax_pending() && !hl_in_flight) {
+        size_t top = global_view.top_line;
+        if (hl_running) editor_hl_dispatch();
+        else if (editor_syntax_advance(HL_STEP, top, top + (size_t)MAX(global_rows, 0))) frame_pending = true;
+    } else if (global_buffer.pool.free_bytes > POOL_COMPACT_MIN) {
+        buffer_compact(&global_buffer);
+    }
 }
 
 /* ----- key reading ------ */
 
+// Reads whatever input is waiting into the ring, without
+// blocking. False if there was none.
+static bool input_fill(void) {
+    size_t used = input_tail - input_head;
+    if (used == INPUT_RING_SIZE) return true;
+
+    size_t pos = input_tail & (INPUT_RING_SIZE - 1);
+    size_t room = MIN(INPUT_RING_SIZE - used, INPUT_RING_SIZE - pos);
+    ssize_t n = read(STDIN_FILENO, &input_ring[pos], room);
+    if (n == -1 && errno != EAGAIN) die("read");
+    if (n <= 0) return false;
+    input_tail += (size_t)n;
+    return true;
+}
+
+// Next input byte, waiting up to timeout_ms for one; -1 if none came
+static int input_byte(int timeout_ms) {
+    if (input_head == input_tail && !input_fill()) {
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) <= 0 || !input_fill()) return -1;
+    }
+    return (unsigned char)input_ring[input_head++ & (INPUT_RING_SIZE - 1)];
+}
+
+// Waits for the next key. Returns NO_KEY instead if a frame is
+// owed, the window was resized or a background save finished, so
+// the caller can redraw.
 static int editor_read_key(void) {
-    char c;
-    while (1) {
-        ssize_t n = read(STDIN_FILENO, &c, 1);
-        if (n == 1) break;
-        if (n == -1 && errno != EAGAIN) die("read");
+    int c;
+    while ((c = input_byte(0)) == -1) {
+        if (editor_frame_due()) return NO_KEY;
+        int ev = editor_wait(editor_idle_work_pending() ? 0 : editor_frame_timeout());
+        if (ev & (EV_RESIZE | EV_SAVE)) return NO_KEY;
+        if (ev == EV_TIMEOUT) editor_do_idle_work();
     }
 
     if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return ESC;
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return ESC;
-
-        if (seq[0] == '[') {
-
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return ESC;
+        int seq0 = input_byte(ESC_TIMEOUT_MS);
+        if (seq0 == -1) return ESC;
+        int seq1 = input_byte(ESC_TIMEOUT_MS);
+        if (seq1 == -1) return ESC;
+
+        if (seq0 == '[') {
+            // ESC [ <parameter and intermediate bytes> <final byte>.
+            // All of it is read, so the tail of one we don't know
+            // (ESC[1;5A and the like) isn't left to be read as keys.
+            int num = 0;
+            bool one_num = true;    // The parameters are a single number
+            int d = seq1;
+            while (d >= 0x20 && d <= 0x3f) {
+                if (d >= '0' && d <= '9') {
+                    if (num < 10000) num = num * 10 + (d - '0');
+                } else {
+                    one_num = false;
+                }
+                d = input_byte(ESC_TIMEOUT_MS);
             }
+            if (d < 0x40 || d > 0x7e) return ESC;
 
-            switch(seq[1]) {
+            switch(d) {
+                // Modified arrows move like plain ones
                 case 'A': return ARROW_UP;
                 case 'B': return ARROW_DOWN;
                 case 'C': return ARROW_RIGHT;
                 case 'D': return ARROW_LEFT;
+                case '~': if (one_num && num == 200) return PASTE; break;
             }
         }
         return ESC;
     }
-    return (unsigned char)c;
+    return c;
+}
+
+// Collects the text of a bracketed paste up to its ESC[201~ end
+// marker, with the terminal's CR and CRLF line ends turned into '\n'
+static void editor_read_paste(struct abuf *out) {
+    static const char end[] = "\x1b[201~";
+    size_t matched = 0;
+    int idle = 0;
+    bool after_cr = false;
+
+    while (matched < sizeof(end) - 1) {
+        int c = input_byte(ESC_TIMEOUT_MS);
+        if (c == -1) {
+            if (++idle >= PASTE_IDLE_MAX) break;
+            continue;
+        }
+        idle = 0;
+
+        if (c == end[matched]) {
+            matched++;
+            continue;
+        }
+        if (matched > 0) {
+            // Not the end marker after all
+            abAppend(out, end, (int)matched);
+            matched = (c == end[0]) ? 1 : 0;
+            if (matched) continue;
+        }
+
+        if (c == '\n' && after_cr) {
+            after_cr = false;
+            continue;
+        }
+        after_cr = (c == '\r');
+        char ch = after_cr ? '\n' : (char)c;
+        abAppend(out, &ch, 1);
+    }
 }
 
 /* ------ syntax highlighting ------ */
@@ -558,114 +2559,397 @@ static int hl_to_ansi(enum Highlight hl) {
 	}
 }
 
+// Filled in by syntax_init()
+static bool separator_table[256];
+
 static bool is_separator(int c) {
-    unsigned char uc = (unsigned char)c;
-    return isspace(uc) || c == '\0' ||
-           strchr(",.()+-/*=~%<>[]{};:&|^!?", uc) != NULL;
+    return separator_table[(unsigned char)c];
 }
 
-static bool filename_is_c_like(const char *fn) {
-    if (!fn) return false;
-    const char *dot = strrchr(fn, '.');
-    if (!dot) return false;
-    return strcmp(dot, ".c") == 0 || strcmp(dot, ".h") == 0 || strcmp(dot, ".cpp") == 0 ||
-        strcmp(dot, ".hpp") == 0;
+static const HlSpan *line_hl_spans(const Line *l) {
+    return l->hl_cap ? l->hl_spans : &l->hl_inline;
 }
 
-static bool filename_is_python_like(const char *fn) {
-    if (!fn) return false;
+// Replaces the line's runs with spans[0..n)
+static void line_hl_store(LinePool *pool, Line *l, const HlSpan *spans, size_t n) {
+    size_t bytes = n * sizeof(HlSpan);
+    if (n > 1 && bytes > l->hl_cap) {
+        if (l->hl_cap) pool_free(pool, l->hl_spans, l->hl_cap);
+        l->hl_spans = pool_alloc(pool, bytes, &l->hl_cap);
+    } else if (n <= 1 && l->hl_cap) {
+        pool_free(pool, l->hl_spans, l->hl_cap);
+        l->hl_cap = 0;
+    }
+    if (l->hl_cap) memcpy(l->hl_spans, spans, bytes);
+    else if (n) l->hl_inline = spans[0];
+    l->hl_n = (uint32_t)n;
+}
+
+// Spans as the highlighter produces them
+typedef struct {
+    HlSpan *v;
+    size_t n, cap;
+} HlSpanBuf;
+
+// Adds a run, merging it into the last one if they touch (spans
+// before first belong to other lines). Runs past what a span can
+// address are left plain.
+static void hl_emit(HlSpanBuf *out, size_t start, size_t len, unsigned char hl, size_t first) {
+    while (len > 0 && start <= UINT32_MAX) {
+        if (out->n > first) {
+            HlSpan *last = &out->v[out->n - 1];
+            if (last->hl == hl && (size_t)last->start + last->len == start && last->len < HL_SPAN_MAX_LEN) {
+                size_t add = MIN(len, (size_t)(HL_SPAN_MAX_LEN - last->len));
+                last->len += (unsigned)add;
+                start += add;
+                len -= add;
+                continue;
+            }
+        }
+        if (out->n == out->cap) {
+            out->cap = out->cap ? out->cap * 2 : 64;
+            out->v = realloc(out->v, out->cap * sizeof(HlSpan));
+            if (!out->v) die("realloc");
+        }
+        size_t take = MIN(len, (size_t)HL_SPAN_MAX_LEN);
+        out->v[out->n++] = (HlSpan){ (uint32_t)start, (unsigned)take, hl };
+        start += take;
+        len -= take;
+    }
+}
+
+// How to highlight one language. The keyword hash is filled in by
+// syntax_init(): a seed is searched for that sends every keyword to
+// its own slot, so looking a word up is one hash and one compare.
+typedef struct {
+    const char *name;
+    enum Language lang;
+    const char *exts[8];
+    const char **keywords;
+    const char *line_comment;   // Comments to the end of the line
+    const char *block_open[2];  // Kinds of block that span lines; NULL if fewer
+    const char *block_close[2];
+    unsigned char block_hl;     // What a block is drawn as
+
+    size_t line_comment_len, block_open_len[2], block_close_len[2];
+    uint32_t kw_seed;
+    size_t kw_max;
+    uint32_t kw_lens[256];      // Bit n set if a keyword of length n starts with this byte
+    unsigned char kw_len[KW_SLOTS];     // 0 for an empty slot
+    const char *kw_slot[KW_SLOTS];
+} Syntax;
+
+static Syntax SYNTAXES[] = {
+    { .name = "C", .lang = C, .exts = { ".c", ".h", NULL }, .keywords = C_KEYWORDS,
+      .line_comment = "//", .block_open = { "/*" }, .block_close = { "*/" }, .block_hl = HL_MLCOMMENT },
+    { .name = "C++", .lang = CPP, .exts = { ".cpp", ".hpp", ".cc", ".cxx", ".hh", ".hxx", NULL }, .keywords = CPP_KEYWORDS,
+      .line_comment = "//", .block_open = { "/*" }, .block_close = { "*/" }, .block_hl = HL_MLCOMMENT },
+    { .name = "Java", .lang = JAVA, .exts = { ".java", NULL }, .keywords = JAVA_KEYWORDS,
+      .line_comment = "//", .block_open = { "/*" }, .block_close = { "*/" }, .block_hl = HL_MLCOMMENT },
+    { .name = "C#", .lang = CS, .exts = { ".cs", NULL }, .keywords = CSHARP_KEYWORDS,
+      .line_comment = "//", .block_open = { "/*" }, .block_close = { "*/" }, .block_hl = HL_MLCOMMENT },
+    // Triple-quoted strings are the only thing that spans lines
+    { .name = "Python", .lang = PYTHON, .exts = { ".py", NULL }, .keywords = PYTHON_KEYWORDS,
+      .line_comment = "#", .block_open = { "\"\"\"", "'''" }, .block_close = { "\"\"\"", "'''" }, .block_hl = HL_STRING },
+};
+#define SYNTAX_COUNT (sizeof(SYNTAXES) / sizeof(SYNTAXES[0]))
+
+// Language of the file being edited, NULL for plain text
+static const Syntax *global_syntax = NULL;
+
+static uint32_t kw_hash(const char *s, size_t len, uint32_t seed) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return (h ^ (h >> 16)) & (KW_SLOTS - 1);
+}
+
+static bool syntax_build_keywords(Syntax *syn, uint32_t seed) {
+    memset(syn->kw_len, 0, sizeof(syn->kw_len));
+    memset(syn->kw_lens, 0, sizeof(syn->kw_lens));
+    for (int k = 0; syn->keywords[k]; k++) {
+        const char *w = syn->keywords[k];
+        size_t len = strlen(w);
+        if (len >= 32) die("keyword too long");
+        uint32_t h = kw_hash(w, len, seed);
+        if (syn->kw_len[h] == len && memcmp(syn->kw_slot[h], w, len) == 0) continue; // Listed twice
+        if (syn->kw_len[h]) return false;
+        syn->kw_len[h] = (unsigned char)len;
+        syn->kw_slot[h] = w;
+        syn->kw_max = MAX(syn->kw_max, len);
+        syn->kw_lens[(unsigned char)w[0]] |= (uint32_t)1 << len;
+    }
+    syn->kw_seed = seed;
+    return true;
+}
+
+static void syntax_init(void) {
+    for (int c = 0; c < 256; c++) {
+        separator_table[c] = isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{};:&|^!?", c) != NULL;
+    }
+
+    for (size_t i = 0; i < SYNTAX_COUNT; i++) {
+        Syntax *syn = &SYNTAXES[i];
+        syn->line_comment_len = strlen(syn->line_comment);
+        for (int k = 0; k < 2; k++) {
+            syn->block_open_len[k] = syn->block_open[k] ? strlen(syn->block_open[k]) : 0;
+            syn->block_close_len[k] = syn->block_close[k] ? strlen(syn->block_close[k]) : 0;
+        }
+
+        uint32_t seed = 2166136261u;
+        while (!syntax_build_keywords(syn, seed)) {
+            seed++;
+            if (seed == 2166136261u + KW_SEED_TRIES) die("keyword table");
+        }
+    }
+}
+
+static const Syntax *syntax_for_filename(const char *fn) {
+    if (!fn) return NULL;
     const char *dot = strrchr(fn, '.');
-    if (!dot) return false;
-    return strcmp(dot, ".py") == 0;
+    if (!dot) return NULL;
+    for (size_t i = 0; i < SYNTAX_COUNT; i++) {
+        for (int e = 0; SYNTAXES[i].exts[e]; e++) {
+            if (strcmp(dot, SYNTAXES[i].exts[e]) == 0) return &SYNTAXES[i];
+        }
+    }
+    return NULL;
 }
 
-// Computes l->hl[i] and whether the line ends inside multiline comment
-static void line_hl_reserve(Line *l, size_t needed) {
-    if (needed <= l->hl_cap) return;
-    size_t cap = (l->hl_cap == 0) ? 16 : l->hl_cap;
-    while (cap < needed) cap *= 2;
-    unsigned char *p = realloc(l->hl, cap);
-    if (!p) die("realloc");
-    l->hl = p;
-    l->hl_cap = cap;
+static bool syntax_is_keyword(const Syntax *syn, const char *s, size_t len) {
+    // Most identifiers are turned away on their first byte and length
+    if (len > syn->kw_max || !(syn->kw_lens[(unsigned char)s[0]] & ((uint32_t)1 << len))) return false;
+    uint32_t h = kw_hash(s, len, syn->kw_seed);
+    return syn->kw_len[h] == len && memcmp(syn->kw_slot[h], s, len) == 0;
 }
 
-static bool is_keyword(const char *s, size_t len) {
-    for (int k = 0; C_KEYWORDS[k]; k++) {
-        if (strlen(C_KEYWORDS[k]) == len && memcmp(C_KEYWORDS[k], s, len) == 0) return true;
+static bool syntax_starts(const char *s, size_t avail, const char *tok, size_t tok_len) {
+    return tok_len && tok_len <= avail && s[0] == tok[0] && memcmp(s, tok, tok_len) == 0;
+}
+
+/* Character classes for the highlighter, worked out 64 bytes at a
+ * time into bit masks so it can jump straight to the next byte that
+ * matters instead of testing every byte.
+ *
+ * A byte's class bits are nib_lo[b & 15] & nib_hi[b >> 4], which the
+ * vector kernels look up for 16 or 32 bytes at once with pshufb. Each
+ * bit stands for a set of low nibbles under some high nibbles:
+ *   0x01  0-9       under 3      0-9
+ *   0x02  1-15      under 4, 6   A-O a-o
+ *   0x04  0-10, 15  under 5      P-Z _
+ *   0x08  0-10      under 7      p-z
+ *   0x10  2 3 7 15  under 2      " # ' /
+ *   0x20  12        under 5      backslash
+ * Every token a Syntax opens with (comments, blocks, quotes) has to
+ * start with one of the special bytes. */
+#define CC_WORD 0x0f
+#define CC_SPECIAL 0x30
+
+// The plain SSE2 kernel compares against the ranges instead
+#if defined(__AVX2__) || defined(__SSSE3__) || !defined(__SSE2__)
+static const unsigned char nib_lo[16] = {
+    0x0d, 0x0f, 0x1f, 0x1f, 0x0f, 0x0f, 0x0f, 0x1f,
+    0x0f, 0x0f, 0x0e, 0x02, 0x22, 0x02, 0x02, 0x16
+};
+static const unsigned char nib_hi[16] = {
+    0x00, 0x00, 0x10, 0x01, 0x02, 0x24, 0x02, 0x08,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+#endif
+
+#if defined(__AVX2__)
+static uint32_t class_mask32(__m256i v, __m256i lo_tbl, __m256i hi_tbl, int bits) {
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lo_tbl, _mm256_and_si256(v, nib));
+    __m256i hi = _mm256_shuffle_epi8(hi_tbl, _mm256_and_si256(_mm256_srli_epi16(v, 4), nib));
+    __m256i c = _mm256_and_si256(_mm256_and_si256(lo, hi), _mm256_set1_epi8((char)bits));
+    return ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_setzero_si256()));
+}
+#elif defined(__SSSE3__)
+static uint16_t class_mask16(__m128i v, __m128i lo_tbl, __m128i hi_tbl, int bits) {
+    const __m128i nib = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_shuffle_epi8(lo_tbl, _mm_and_si128(v, nib));
+    __m128i hi = _mm_shuffle_epi8(hi_tbl, _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+    __m128i c = _mm_and_si128(_mm_and_si128(lo, hi), _mm_set1_epi8((char)bits));
+    return (uint16_t)~_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_setzero_si128()));
+}
+#elif defined(__SSE2__)
+// No pshufb: compare against the ranges directly. Bytes from 0x80
+// up are negative here, so they fall below every range.
+static __m128i sse2_in_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)(lo - 1))),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8((char)(hi + 1))));
+}
+
+static __m128i sse2_eq(__m128i v, char c) {
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+#endif
+
+// Bit k of *word / *special is set if s[k] is an identifier byte / a
+// special byte. s holds 64 readable bytes, of which the first n count.
+static void class_masks64(const char *s, size_t n, uint64_t *word, uint64_t *special) {
+    *word = *special = 0;
+#if defined(__AVX2__)
+    const __m256i lo_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)nib_lo));
+    const __m256i hi_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)nib_hi));
+    for (size_t k = 0; k < 2 && 32 * k < n; k++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + 32 * k));
+        *word |= (uint64_t)class_mask32(v, lo_tbl, hi_tbl, CC_WORD) << (32 * k);
+        *special |= (uint64_t)class_mask32(v, lo_tbl, hi_tbl, CC_SPECIAL) << (32 * k);
     }
-    return false;
+#elif defined(__SSSE3__)
+    const __m128i lo_tbl = _mm_loadu_si128((const __m128i *)nib_lo);
+    const __m128i hi_tbl = _mm_loadu_si128((const __m128i *)nib_hi);
+    for (size_t k = 0; k < 4 && 16 * k < n; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + 16 * k));
+        *word |= (uint64_t)class_mask16(v, lo_tbl, hi_tbl, CC_WORD) << (16 * k);
+        *special |= (uint64_t)class_mask16(v, lo_tbl, hi_tbl, CC_SPECIAL) << (16 * k);
+    }
+#elif defined(__SSE2__)
+    for (size_t k = 0; k < 4 && 16 * k < n; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + 16 * k));
+        // Setting 0x20 folds A-Z onto a-z and nothing else onto it
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i w = _mm_or_si128(_mm_or_si128(sse2_in_range(v, '0', '9'), sse2_in_range(folded, 'a', 'z')),
+                                 sse2_eq(v, '_'));
+        __m128i sp = _mm_or_si128(_mm_or_si128(sse2_eq(v, '"'), sse2_eq(v, '#')),
+                                  _mm_or_si128(_mm_or_si128(sse2_eq(v, '\''), sse2_eq(v, '/')), sse2_eq(v, '\\')));
+        *word |= (uint64_t)(unsigned)_mm_movemask_epi8(w) << (16 * k);
+        *special |= (uint64_t)(unsigned)_mm_movemask_epi8(sp) << (16 * k);
+    }
+#else
+    for (size_t k = 0; k < n; k++) {
+        unsigned char b = (unsigned char)s[k];
+        unsigned c = nib_lo[b & 15] & nib_hi[b >> 4];
+        if (c & CC_WORD) *word |= (uint64_t)1 << k;
+        if (c & CC_SPECIAL) *special |= (uint64_t)1 << k;
+    }
+#endif
+}
+
+// The masks of the 64-byte window of a line that was looked at last
+typedef struct {
+    const char *s;
+    size_t len;
+    size_t base;        // Window start, SIZE_MAX before the first one
+    uint64_t word, special;
+} ClassScan;
+
+static void class_scan_load(ClassScan *cs, size_t i) {
+    size_t base = i & ~(size_t)63;
+    if (cs->base == base) return;
+    cs->base = base;
+    if (base + 64 <= cs->len) {
+        class_masks64(cs->s + base, 64, &cs->word, &cs->special);
+    } else {
+        // The end of the line, padded with bytes of no class
+        char tail[64] = {0};
+        memcpy(tail, cs->s + base, cs->len - base);
+        class_masks64(tail, cs->len - base, &cs->word, &cs->special);
+    }
+}
+
+// First byte at or after i whose class is in `which` (0 = word,
+// 1 = special, 2 = either), or not a word byte if `which` is 3.
+// Returns len if there's none.
+enum { CS_WORD, CS_SPECIAL, CS_ANY, CS_NOT_WORD };
+static size_t class_scan_next(ClassScan *cs, size_t i, int which) {
+    while (i < cs->len) {
+        class_scan_load(cs, i);
+        uint64_t m = which == CS_WORD ? cs->word
+                   : which == CS_SPECIAL ? cs->special
+                   : which == CS_ANY ? (cs->word | cs->special)
+                   : ~cs->word;
+        m >>= (i - cs->base);
+        if (m) return MIN(i + (size_t)__builtin_ctzll(m), cs->len);
+        i = cs->base + 64;
+    }
+    return cs->len;
 }
 
-static bool editor_update_syntax_line(size_t row, bool in_comment) {
-    Line *l = &global_buffer.lines[row];
-    line_hl_reserve(l, l->len);
-    memset(l->hl, HL_NORMAL, l->len);
+// Appends the coloured runs of the text s to out, starting inside
+// multiline block in_block (1 or 2, 0 for none). Returns the block it
+// ends inside. Touches nothing else, so the highlighting thread can
+// use it too.
+static int syntax_highlight(const Syntax *syn, const char *s, size_t len, HlSpanBuf *out, int in_block) {
+    size_t first = out->n;
+    ClassScan cs = { s, len, SIZE_MAX, 0, 0 };
 
     size_t i = 0;
-    while (i < l->len) {
-        char c = l->data[i];
-
-        if (in_comment) {
-            l->hl[i] = HL_MLCOMMENT;
-            if (c == '*' && i + 1 < l->len && l->data[i+1] == '/') {
-                l->hl[i] = HL_MLCOMMENT;
-                l->hl[i+1] = HL_MLCOMMENT;
-                i += 2;
-                in_comment = false;
-                continue;
+    while (i < len) {
+        if (in_block) {
+            const char *close = syn->block_close[in_block - 1];
+            size_t close_len = syn->block_close_len[in_block - 1];
+            size_t j = i;
+            for (;;) {
+                const char *p = memchr(&s[j], close[0], len - j);
+                if (!p) {
+                    hl_emit(out, i, len - i, syn->block_hl, first);
+                    return in_block;
+                }
+                j = (size_t)(p - s);
+                if (syntax_starts(&s[j], len - j, close, close_len)) break;
+                j++;
             }
-            i++;
+            j += close_len;
+            hl_emit(out, i, j - i, syn->block_hl, first);
+            i = j;
+            in_block = 0;
             continue;
         }
 
-        if (c == '/' && i + 1 < l->len && l->data[i+1] == '/') {
-            for (size_t j = i; j < l->len; j++) l->hl[j] = HL_COMMENT;
+        // Nothing but identifiers and special bytes starts a token
+        i = class_scan_next(&cs, i, CS_ANY);
+        if (i >= len) break;
+        char c = s[i];
+
+        if (syntax_starts(&s[i], len - i, syn->line_comment, syn->line_comment_len)) {
+            hl_emit(out, i, len - i, HL_COMMENT, first);
             break;
         }
 
-        if (c == '/' && i + 1 < l->len && l->data[i + 1] == '*') {
-            l->hl[i] = HL_MLCOMMENT;
-            l->hl[i+1] = HL_MLCOMMENT;
-            i += 2;
-            in_comment = true;
+        if (syntax_starts(&s[i], len - i, syn->block_open[0], syn->block_open_len[0])) in_block = 1;
+        else if (syntax_starts(&s[i], len - i, syn->block_open[1], syn->block_open_len[1])) in_block = 2;
+        if (in_block) {
+            hl_emit(out, i, syn->block_open_len[in_block - 1], syn->block_hl, first);
+            i += syn->block_open_len[in_block - 1];
             continue;
         }
 
         if (c == '"' || c == '\'') {
-            char quote = c;
-            l->hl[i++] = HL_STRING;
-            while (i < l->len) {
-                l->hl[i] = HL_STRING;
-                if (l->data[i] == '\\' && i+1 < l->len) {
-                    l->hl[i+1] = HL_STRING;
-                    i += 2;
+            // Quotes and backslashes are both special, so the
+            // closing quote is found a mask at a time
+            size_t j = i + 1;
+            for (;;) {
+                j = class_scan_next(&cs, j, CS_SPECIAL);
+                if (j >= len) break;
+                if (s[j] == '\\') {
+                    j = MIN(j + 2, len);
                     continue;
                 }
-                if (l->data[i] == quote) {i++; break;}
-                i++;
+                j++;
+                if (s[j - 1] == c) break;
             }
+            hl_emit(out, i, j - i, HL_STRING, first);
+            i = j;
             continue;
         }
 
-        if (isdigit((unsigned char)c) && (i == 0 || is_separator(l->data[i-1]))) {
+        if (isdigit((unsigned char)c) && (i == 0 || is_separator(s[i-1]))) {
             size_t j = i;
-            while (j < l->len && (isdigit((unsigned char)l->data[j]) || l->data[j]=='.')) {
-                l->hl[j] = HL_NUMBER;
-                j++;
-            }
+            while (j < len && (isdigit((unsigned char)s[j]) || s[j]=='.')) j++;
+            hl_emit(out, i, j - i, HL_NUMBER, first);
             i = j;
             continue;
         }
 
         if (isalpha((unsigned char)c) || c == '_') {
             size_t start = i;
-            size_t j = i;
-            while (j < l->len && (isalnum((unsigned char)l->data[j]) || l->data[j]=='_')) j++; 
-            bool kw = is_keyword(&l->data[start], j - start);
-            if (kw && (start == 0 || is_separator(l->data[start - 1])) &&
-                (j == l->len || is_separator(l->data[j]))) {
-                    for (size_t k = start; k < j; k++) l->hl[k] = HL_KEYWORD;
+            size_t j = class_scan_next(&cs, i, CS_NOT_WORD);
+            bool kw = syntax_is_keyword(syn, &s[start], j - start);
+            if (kw && (start == 0 || is_separator(s[start - 1])) &&
+                (j == len || is_separator(s[j]))) {
+                    hl_emit(out, start, j - start, HL_KEYWORD, first);
                 }
 
                 i = j;
@@ -673,31 +2957,468 @@ static bool editor_update_syntax_line(size_t row, bool in_comment) {
         }
         i++;
     }
-    bool changed = (l->hl_open_comment != in_comment);
-    l->hl_open_comment = in_comment;
+    return in_block;
+}
+
+static bool editor_update_syntax_line(size_t row, int in_comment) {
+    Line *l = buffer_line(&global_buffer, row);
+
+    // Scratch for the UI thread, reused line after line
+    static HlSpanBuf spans;
+    spans.n = 0;
+    int open = syntax_highlight(global_syntax, l->data, l->len, &spans, in_comment);
+    line_hl_store(&global_buffer.pool, l, spans.v, spans.n);
+
+    unsigned char *st = buffer_hl_state(&global_buffer, row);
+    bool changed = hls_open(*st) != open;
+    *st = hls_make(in_comment, open);
     return changed;
 }
 
-static void editor_update_syntax_from(size_t start_row) {
-    if (!filename_is_c_like(global_filename)) return;
-    if (start_row >= global_buffer.line_count) return;
+// Highlights row unless its hl is still good for in_comment.
+// Returns the block the row ends inside.
+static int editor_syntax_refresh_line(size_t row, int in_comment) {
+    unsigned char st = *buffer_hl_state(&global_buffer, row);
+    if (!hl_state_fits(st, in_comment)) {
+        editor_update_syntax_line(row, in_comment);
+        st = *buffer_hl_state(&global_buffer, row);
+    }
+    return hls_open(st);
+}
 
-    bool in_comment = false;
-    if (start_row > 0) in_comment = global_buffer.lines[start_row - 1].hl_open_comment;
+// Moves the valid-highlighting frontier on by up to max lines.
+// Lines it passes that are already right cost only a check.
+// Returns whether it had to redo any row in [from, to).
+static bool editor_syntax_advance(size_t max, size_t from, size_t to) {
+    Buffer *b = &global_buffer;
+    if (!global_syntax) return false;
+
+    size_t end = b->hl_valid + MIN(max, b->line_count - b->hl_valid);
+    int in_comment = b->hl_valid > 0 ? hls_open(*buffer_hl_state(b, b->hl_valid - 1)) : 0;
+    bool redone = false;
+    for (; b->hl_valid < end; b->hl_valid++) {
+        bool stale = !hl_state_fits(*buffer_hl_state(b, b->hl_valid), in_comment);
+        if (stale && b->hl_valid >= from && b->hl_valid < to) redone = true;
+        in_comment = editor_syntax_refresh_line(b->hl_valid, in_comment);
+    }
+    return redone;
+}
 
-    for (size_t r = start_row; r < global_buffer.line_count; r++) {
-        bool prev_open = global_buffer.lines[r].hl_open_comment;
+// Gets rows [first, last) ready to be drawn. A nearby frontier is
+// walked up to them; from far away they're highlighted from the
+// state the row above was last left in, and put right once the
+// frontier catches up.
+static void editor_syntax_view(size_t first, size_t last) {
+    Buffer *b = &global_buffer;
+    if (!global_syntax) return;
+    last = MIN(last, b->line_count);
+    if (first >= last) return;
+
+    if (first <= b->hl_valid + HL_CATCHUP_MAX) {
+        if (last > b->hl_valid) editor_syntax_advance(last - b->hl_valid, 0, 0);
+        return;
+    }
 
-        editor_update_syntax_line(r, in_comment);
-        in_comment = global_buffer.lines[r].hl_open_comment;
+    unsigned char above = *buffer_hl_state(b, first - 1);
+    int in_comment = (above & HLS_OK) ? hls_open(above) : 0;
+    for (size_t r = first; r < last; r++) in_comment = editor_syntax_refresh_line(r, in_comment);
+}
 
-        bool next_missing = (r + 1 < global_buffer.line_count) &&
-                            (global_buffer.lines[r + 1].hl == NULL);
+static bool editor_syntax_pending(void) {
+    return global_syntax && global_buffer.hl_valid < global_buffer.line_count;
+}
 
-        if (global_buffer.lines[r].hl_open_comment == prev_open && !next_missing) {
-            break;
+static void rope_forget_highlight(RopeNode *node) {
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; i++) rope_forget_highlight(node->kids[i]);
+    } else if (node->lines) {
+        memset(node->hl_state, 0, (size_t)node->n);
+    }
+}
+
+// Picks the language from the file name. A different one means
+// everything highlighted so far has to be done again.
+static void editor_select_syntax(void) {
+    const Syntax *syn = syntax_for_filename(global_filename);
+    if (syn == global_syntax) return;
+    global_syntax = syn;
+    rope_forget_highlight(global_buffer.root);
+    global_buffer.hl_valid = 0;
+    global_buffer.hl_version++;
+}
+
+// mpad --bench-highlight <file>: highlights every line of the file
+// with each language's rules and reports the throughput.
+static int bench_highlight(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return 1;
+    }
+    Buffer b = {0};
+    b.root = rope_node_new(true);
+    buffer_read_file(&b, fp);
+    fclose(fp);
+
+    size_t bytes = 0;
+    for (size_t r = 0; r < b.line_count; r++) bytes += buffer_line(&b, r)->len;
+
+    syntax_init();
+    HlSpanBuf spans = {0};
+    for (size_t i = 0; i < SYNTAX_COUNT; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int in_block = 0;
+        size_t runs = 0;
+        for (size_t r = 0; r < b.line_count; r++) {
+            Line *l = buffer_line(&b, r);
+            spans.n = 0;
+            in_block = syntax_highlight(&SYNTAXES[i], l->data, l->len, &spans, in_block);
+            runs += spans.n;
         }
+        double secs = elapsed_since(&start);
+        printf("%-8s %zu lines, %.1f MB in %.3f s: %.1f MB/s, %zu runs in %.1f MB\n", SYNTAXES[i].name,
+               b.line_count, (double)bytes / 1e6, secs, secs > 0 ? (double)bytes / 1e6 / secs : 0.0,
+               runs, (double)(runs * sizeof(HlSpan)) / 1e6);
     }
+    free(spans.v);
+    buffer_free(&b);
+    return 0;
+}
+
+/* ----- background highlighting ------ */
+
+// A worker thread carries the frontier through the rest of the
+// file. The UI thread copies the next run of stale lines into the
+// job, the worker highlights the copy, and the result is only taken
+// if the buffer's hl_version still matches the one it was copied at.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool queued;            // The worker owns the job
+
+    unsigned long version;
+    size_t start;           // First row copied
+    size_t n;
+    const Syntax *syntax;
+    int in_comment;         // Block row start is entered in
+    char *text;             // Row i is text[ends[i-1], ends[i])
+    size_t text_cap;
+    size_t *ends;
+    HlSpanBuf spans;        // Row i's runs end at spans.v[span_ends[i]]
+    size_t *span_ends;
+    unsigned char *open;    // Block row i ends inside
+} HlJob;
+
+static HlJob hl_job = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static void *hl_worker_main(void *arg) {
+    HlJob *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (!job->queued) pthread_cond_wait(&job->wake, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+
+        int in_comment = job->in_comment;
+        size_t from = 0;
+        job->spans.n = 0;
+        for (size_t i = 0; i < job->n; i++) {
+            in_comment = syntax_highlight(job->syntax, job->text + from, job->ends[i] - from, &job->spans, in_comment);
+            job->span_ends[i] = job->spans.n;
+            job->open[i] = (unsigned char)in_comment;
+            from = job->ends[i];
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->queued = false;
+        write(hl_pipe[1], "", 1);
+    }
+    return NULL;
+}
+
+// Starts the highlighting thread. Without it idle steps do the work.
+static void editor_hl_start(void) {
+    HlJob *job = &hl_job;
+    job->text_cap = HL_JOB_BYTES;
+    job->text = malloc(job->text_cap);
+    job->ends = malloc(HL_STEP * sizeof(size_t));
+    job->span_ends = malloc(HL_STEP * sizeof(size_t));
+    job->open = malloc(HL_STEP);
+    if (!job->text || !job->ends || !job->span_ends || !job->open) die("malloc");
+
+    if (pipe(hl_pipe) == -1) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(hl_pipe[i], F_SETFL, fcntl(hl_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(hl_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    // Leave SIGWINCH to the UI thread
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    pthread_t tid;
+    hl_running = (pthread_create(&tid, NULL, hl_worker_main, job) == 0);
+    if (hl_running) pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Moves the frontier over rows that are already right, then hands
+// the worker a copy of the stale run after them
+static void editor_hl_dispatch(void) {
+    Buffer *b = &global_buffer;
+    HlJob *job = &hl_job;
+
+    int in_comment = b->hl_valid > 0 ? hls_open(*buffer_hl_state(b, b->hl_valid - 1)) : 0;
+    for (size_t checked = 0; b->hl_valid < b->line_count; b->hl_valid++) {
+        unsigned char st = *buffer_hl_state(b, b->hl_valid);
+        if (!hl_state_fits(st, in_comment)) break;
+        // Leave the rest of a long clean stretch for the next step
+        if (++checked > HL_STEP) return;
+        in_comment = hls_open(st);
+    }
+    if (b->hl_valid >= b->line_count) return;
+
+    size_t n = 0, bytes = 0;
+    for (size_t r = b->hl_valid; r < b->line_count && n < HL_STEP; r++) {
+        Line *l = buffer_line(b, r);
+        if (n > 0 && bytes + l->len > HL_JOB_BYTES) break;
+        if (bytes + l->len > job->text_cap) {
+            // A single line bigger than a whole job
+            job->text_cap = bytes + l->len;
+            job->text = realloc(job->text, job->text_cap);
+            if (!job->text) die("realloc");
+        }
+        memcpy(job->text + bytes, l->data, l->len);
+        bytes += l->len;
+        job->ends[n++] = bytes;
+    }
+
+    job->version = b->hl_version;
+    job->start = b->hl_valid;
+    job->n = n;
+    job->syntax = global_syntax;
+    job->in_comment = in_comment;
+
+    pthread_mutex_lock(&job->lock);
+    job->queued = true;
+    pthread_cond_signal(&job->wake);
+    pthread_mutex_unlock(&job->lock);
+    hl_in_flight = true;
+}
+
+// Takes in a finished job, unless the buffer was edited since it
+// was copied. Returns whether any row on screen changed.
+static bool editor_hl_collect(void) {
+    Buffer *b = &global_buffer;
+    HlJob *job = &hl_job;
+
+    pthread_mutex_lock(&job->lock);
+    bool queued = job->queued;
+    pthread_mutex_unlock(&job->lock);
+    if (!hl_in_flight || queued) return false;
+    hl_in_flight = false;
+    if (job->version != b->hl_version) return false;
+
+    size_t top = global_view.top_line;
+    size_t bottom = top + (size_t)MAX(global_rows, 0);
+    bool redrawn = false;
+    int in_comment = job->in_comment;
+    size_t from = 0;
+    for (size_t i = 0; i < job->n; i++) {
+        size_t row = job->start + i;
+        unsigned char *st = buffer_hl_state(b, row);
+        // Rows the frontier got to first are already right
+        if (row >= b->hl_valid && !hl_state_fits(*st, in_comment)) {
+            *st = hls_make(in_comment, job->open[i]);
+            line_hl_store(&b->pool, buffer_line(b, row), job->spans.v + from, job->span_ends[i] - from);
+            if (row >= top && row < bottom) redrawn = true;
+        }
+        in_comment = job->open[i];
+        from = job->span_ends[i];
+    }
+    b->hl_valid = MAX(b->hl_valid, job->start + job->n);
+    return redrawn;
+}
+
+/* ------ search ------- */
+
+static void search_set(Search *s, const char *pat, size_t len) {
+    len = MIN(len, sizeof(s->pat));
+    memcpy(s->pat, pat, len);
+    s->len = len;
+    memset(s->skip, (int)MAX(len, 1), sizeof(s->skip));
+    for (size_t i = 0; i + 1 < len; i++) s->skip[(unsigned char)pat[i]] = (unsigned char)(len - 1 - i);
+}
+
+// First match of the pattern in text[from, n), or SIZE_MAX.
+//
+// Search kernel: compares a whole vector of candidate positions
+// against the pattern's first and last bytes at once, so only spots
+// where both agree get a memcmp of the middle. Whatever the vectors
+// don't cover goes to Horspool.
+static size_t search_find(const Search *s, const char *text, size_t n, size_t from) {
+    size_t m = s->len;
+    if (m == 0 || from > n || n - from < m) return SIZE_MAX;
+    if (m == 1) {
+        const char *p = memchr(text + from, s->pat[0], n - from);
+        return p ? (size_t)(p - text) : SIZE_MAX;
+    }
+
+    size_t i = from;
+#if defined(__AVX2__)
+    const __m256i first = _mm256_set1_epi8(s->pat[0]);
+    const __m256i last = _mm256_set1_epi8(s->pat[m - 1]);
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(text + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(text + i + m - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(text + at + 1, s->pat + 1, m - 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(s->pat[0]);
+    const __m128i last = _mm_set1_epi8(s->pat[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(text + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(text + at + 1, s->pat + 1, m - 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // Scalar fallback, and the tail the vector loop didn't cover
+    while (i + m <= n) {
+        unsigned char c = (unsigned char)text[i + m - 1];
+        if (c == (unsigned char)s->pat[m - 1] && memcmp(text + i, s->pat, m - 1) == 0) return i;
+        i += s->skip[c];
+    }
+    return SIZE_MAX;
+}
+
+// Last match in text[0, n) that starts before limit, or SIZE_MAX.
+static size_t search_find_last(const Search *s, const char *text, size_t n, size_t limit) {
+    size_t best = SIZE_MAX;
+    for (size_t at = search_find(s, text, n, 0); at < limit; at = search_find(s, text, n, at + 1)) {
+        best = at;
+    }
+    return best;
+}
+
+// The leaf holding row, and the row its first line is.
+static RopeNode *rope_leaf_at(RopeNode *node, size_t row, size_t *start) {
+    size_t idx = row;
+    while (!node->leaf) node = node->kids[rope_child_for(node, &idx)];
+    *start = row - idx;
+    return node;
+}
+
+// Where line idx of a span leaf starts in its text
+static size_t span_line_offset(const RopeNode *leaf, size_t idx) {
+    const char *p = leaf->span;
+    const char *end = leaf->span + leaf->span_len;
+    for (size_t i = 0; i < idx && p < end; i++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        p = nl ? nl + 1 : end;
+    }
+    return (size_t)(p - leaf->span);
+}
+
+// Turns an offset in a span leaf's text into a line and column.
+static void span_position(const RopeNode *leaf, size_t off, size_t *idx, size_t *col) {
+    const char *p = leaf->span;
+    const char *end = leaf->span + off;
+    *idx = 0;
+    const char *nl;
+    while ((nl = memchr(p, '\n', (size_t)(end - p)))) {
+        (*idx)++;
+        p = nl + 1;
+    }
+    *col = (size_t)(end - p);
+}
+
+// Looks through a leaf for the first match from line idx, column
+// col on, or with backward the last one before it. Leaves still
+// waiting as a span of the mapping are searched as they are, in
+// one go; the pattern never holds a '\n', so a match can't run
+// from one line into the next.
+static bool search_leaf(const Search *s, const RopeNode *leaf, size_t *idx, size_t *col, bool backward) {
+    if (!leaf->lines) {
+        // Backwards from past the end needs no line counting
+        size_t at = leaf->span_len;
+        if (*col != SIZE_MAX || *idx + 1 < (size_t)leaf->n) {
+            size_t off = span_line_offset(leaf, *idx);
+            at = MIN(*col, leaf->span_len - off) + off;
+        }
+        at = backward ? search_find_last(s, leaf->span, leaf->span_len, at)
+                      : search_find(s, leaf->span, leaf->span_len, at);
+        if (at == SIZE_MAX) return false;
+        span_position(leaf, at, idx, col);
+        return true;
+    }
+
+    size_t i = *idx;
+    size_t from = *col;
+    for (;;) {
+        const Line *l = &leaf->lines[i];
+        size_t at = backward ? search_find_last(s, l->data, l->len, from)
+                             : search_find(s, l->data, l->len, from);
+        if (at != SIZE_MAX) {
+            *idx = i;
+            *col = at;
+            return true;
+        }
+        if (backward ? i == 0 : i + 1 >= (size_t)leaf->n) return false;
+        i = backward ? i - 1 : i + 1;
+        from = backward ? SIZE_MAX : 0;
+    }
+}
+
+// Moves at to the next match after it (before it, with backward),
+// going round the end of the buffer if it has to. *wrapped says if
+// it did.
+static bool buffer_search(Buffer *b, const Search *s, Cursor *at, bool backward, bool *wrapped) {
+    if (s->len == 0) return false;
+    buffer_index_all(b);
+    if (b->line_count == 0) return false;
+
+    size_t last = b->line_count - 1;
+    size_t row = MIN(at->row, last);
+    size_t col = backward ? at->col : at->col + 1;
+    for (int pass = 0; pass < 2; pass++) {
+        *wrapped = (pass == 1);
+        for (;;) {
+            size_t start;
+            RopeNode *leaf = rope_leaf_at(b->root, row, &start);
+            size_t idx = row - start;
+            if (search_leaf(s, leaf, &idx, &col, backward)) {
+                at->row = start + idx;
+                at->col = col;
+                return true;
+            }
+            // The second time round, stop at the row it started on
+            if (backward) {
+                if (start == 0 || (pass == 1 && start <= at->row)) break;
+                row = start - 1;
+                col = SIZE_MAX;
+            } else {
+                row = start + (size_t)leaf->n;
+                col = 0;
+                if (row > last || (pass == 1 && row > at->row)) break;
+            }
+        }
+        row = backward ? last : 0;
+        col = backward ? SIZE_MAX : 0;
+    }
+    return false;
 }
 
 /* ------ line nums / gutter ------- */
@@ -708,62 +3429,340 @@ static int digits_size_t(size_t n) {
         n /= 10;
         d++;
     }
-    return d;
+    return d;
+}
+
+// Columns left for text once the line number gutter is drawn
+static int editor_text_cols(int cols) {
+    int text_cols = cols - (digits_size_t(global_buffer.line_count) + 2);
+    return MAX(1, text_cols);
+}
+
+/* ------ screen mapping/render helpers ------- */
+
+// Display width of s[from, to), for text that starts at
+// display column width
+static int text_width_from(const char *s, size_t from, size_t to, int width) {
+    for (size_t i = from; i < to; i++) {
+        if (s[i] == '\t') {
+            int add = TAB_WIDTH - (width % TAB_WIDTH);
+	        width += add;
+	    } else {
+	        width += 1;
+	    }
+    }
+    return width;
+}
+
+// Gives a long line its width checkpoints, if it doesn't
+// have them yet.
+static void line_width_index(Line *l) {
+    size_t steps = l->len / LINE_WIDTH_STEP;
+    if (steps == 0 || l->width_ckpt) return;
+
+    l->width_ckpt = malloc(steps * sizeof(int));
+    if (!l->width_ckpt) die("malloc");
+
+    int width = 0;
+    for (size_t k = 0; k < steps; k++) {
+        width = text_width_from(l->data, k * LINE_WIDTH_STEP, (k + 1) * LINE_WIDTH_STEP, width);
+        l->width_ckpt[k] = width;
+    }
+}
+
+// Display width of the whole line.
+static int line_width(Line *l) {
+    size_t steps = l->len / LINE_WIDTH_STEP;
+    if (steps == 0) return text_width_from(l->data, 0, l->len, 0);
+    line_width_index(l);
+    return text_width_from(l->data, steps * LINE_WIDTH_STEP, l->len, l->width_ckpt[steps - 1]);
+}
+
+// How many terminal columns does this prefix of the
+// line occupy?
+static int visual_width_upto(Line *l, size_t upto_col) {
+    size_t end = MIN(upto_col, l->len);
+    if (end < LINE_WIDTH_STEP) return text_width_from(l->data, 0, end, 0);
+
+    line_width_index(l);
+    size_t k = end / LINE_WIDTH_STEP;
+    return text_width_from(l->data, k * LINE_WIDTH_STEP, end, l->width_ckpt[k - 1]);
+}
+
+// Byte offset of the character that covers display column vcol
+// (l->len if the line is narrower), and the column it starts at.
+// Lets a wrapped row be drawn without walking the line from 0.
+static size_t line_offset_at_width(Line *l, int vcol, int *start_width) {
+    size_t from = 0;
+    int width = 0;
+
+    if (l->len >= LINE_WIDTH_STEP) {
+        line_width_index(l);
+        // Last checkpoint at or before vcol
+        size_t lo = 0, hi = l->len / LINE_WIDTH_STEP;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo + 1) / 2;
+            if (l->width_ckpt[mid - 1] <= vcol) lo = mid;
+            else hi = mid - 1;
+        }
+        if (lo > 0) {
+            from = lo * LINE_WIDTH_STEP;
+            width = l->width_ckpt[lo - 1];
+        }
+    }
+
+    size_t i = from;
+    for (; i < l->len; i++) {
+        int next = text_width_from(l->data, i, i + 1, width);
+        if (next > vcol) break;
+        width = next;
+    }
+    *start_width = width;
+    return i;
+}
+
+static int rows_for_width(int width, int screen_cols) {
+    // Most lines fit on one row; skip the divide for them
+    if (width <= screen_cols) return 1;
+    return (width + screen_cols - 1) / screen_cols;
+}
+
+// Display width of line i of an expanded leaf, measured once
+// and then kept until the line changes.
+static int rope_leaf_width(RopeNode *leaf, int i) {
+    if (leaf->widths[i] < 0) leaf->widths[i] = line_width(&leaf->lines[i]);
+    return leaf->widths[i];
+}
+
+// Screen rows of lines [from, to) of an expanded leaf. Only reads
+// the widths array, unless a line still has to be measured.
+static size_t rope_leaf_rows(RopeNode *leaf, int from, int to, int screen_cols) {
+    size_t rows = 0;
+    for (int i = from; i < to; i++) {
+        int width = leaf->widths[i];
+        if (width < 0) width = rope_leaf_width(leaf, i);
+        rows += (size_t)rows_for_width(width, screen_cols);
+    }
+    return rows;
+}
+
+// How many screen rows does a line occupy?
+static int buffer_line_rows(Buffer *b, size_t row, int screen_cols) {
+    buffer_line(b, row);
+    return rows_for_width(rope_leaf_width(b->cache_leaf, (int)(row - b->cache_start)), screen_cols);
+}
+
+// Rows of the n lines in a span of mapped text, without
+// building Line structs for them
+static size_t span_rows(const char *p, size_t len, int n, int screen_cols) {
+    const char *end = p + len;
+    size_t rows = 0;
+    for (int i = 0; i < n; i++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t len = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        rows += (size_t)rows_for_width(text_width_from(p, 0, len, 0), screen_cols);
+        p = nl ? nl + 1 : end;
+    }
+    return rows;
+}
+
+// Screen rows of a whole subtree. Cached per node for one text
+// width, so after a resize only the parts that get asked about
+// are recounted.
+static size_t rope_rows(RopeNode *node, int screen_cols) {
+    if (node->rows_width == screen_cols) return node->rows;
+
+    size_t rows = 0;
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; i++) rows += rope_rows(node->kids[i], screen_cols);
+    } else if (!node->lines) {
+        rows = span_rows(node->span, node->span_len, node->n, screen_cols);
+    } else {
+        rows = rope_leaf_rows(node, 0, node->n, screen_cols);
+    }
+    node->rows = rows;
+    node->rows_width = screen_cols;
+    return rows;
+}
+
+// Screen rows of lines [from, to) below node, both relative to it.
+static size_t rope_rows_range(RopeNode *node, size_t from, size_t to, int screen_cols) {
+    if (from >= to) return 0;
+    if (from == 0 && to == node->count) return rope_rows(node, screen_cols);
+
+    size_t rows = 0;
+    if (node->leaf) {
+        rope_leaf_expand(node);
+        return rope_leaf_rows(node, (int)from, (int)to, screen_cols);
+    }
+
+    size_t base = 0;
+    for (int i = 0; i < node->n && base < to; i++) {
+        size_t c = node->kids[i]->count;
+        if (base + c > from) {
+            rows += rope_rows_range(node->kids[i], from > base ? from - base : 0, MIN(to - base, c), screen_cols);
+        }
+        base += c;
+    }
+    return rows;
+}
+
+// mpad --bench-rows <file>: times full scans of the per-line data
+// that row counting and the highlight frontier read, at text widths
+// the row caches haven't seen, and reports lines per second.
+#define BENCH_ROWS_PASSES 10
+
+static int bench_rows(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return 1;
+    }
+    Buffer b = {0};
+    b.root = rope_node_new(true);
+    buffer_read_file(&b, fp);
+    fclose(fp);
+    size_t n = b.line_count;
+
+    // Measures every width, so the passes after it only miss the row caches
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t rows = rope_rows(b.root, 80);
+    double secs = elapsed_since(&start);
+    printf("%-16s %zu lines, %zu rows in %.3f s\n", "measure widths", n, rows, secs);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rows = 0;
+    for (int c = 81; c < 81 + BENCH_ROWS_PASSES; c++) rows += rope_rows(b.root, c);
+    secs = elapsed_since(&start);
+    printf("%-16s %.1f M lines/s (%zu rows)\n", "rope_rows", secs > 0 ? (double)n * BENCH_ROWS_PASSES / 1e6 / secs : 0.0, rows);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rows = 0;
+    for (int c = 101; c < 101 + BENCH_ROWS_PASSES; c++) rows += rope_rows_range(b.root, 1, n > 1 ? n - 1 : n, c);
+    secs = elapsed_since(&start);
+    printf("%-16s %.1f M lines/s (%zu rows)\n", "rope_rows_range", secs > 0 ? (double)n * BENCH_ROWS_PASSES / 1e6 / secs : 0.0, rows);
+
+    for (size_t r = 0; r < n; r++) *buffer_hl_state(&b, r) = HLS_OK;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t ok = 0;
+    for (int k = 0; k < BENCH_ROWS_PASSES; k++) {
+        for (size_t r = 0; r < n; r++) ok += hl_state_fits(*buffer_hl_state(&b, r), 0);
+    }
+    secs = elapsed_since(&start);
+    printf("%-16s %.1f M lines/s (%zu ok)\n", "hl state check", secs > 0 ? (double)n * BENCH_ROWS_PASSES / 1e6 / secs : 0.0, ok);
+
+    buffer_free(&b);
+    return 0;
+}
+
+// Walks forward from line `from`, skipping whole lines while their
+// rows fit in *budget. Returns the line the leftover budget lands
+// in, or node->count if it runs past the end.
+static size_t rope_skip_rows(RopeNode *node, size_t from, size_t *budget, int screen_cols) {
+    if (node->leaf) {
+        rope_leaf_expand(node);
+        for (size_t i = from; i < (size_t)node->n; i++) {
+            size_t r = (size_t)rows_for_width(rope_leaf_width(node, (int)i), screen_cols);
+            if (r > *budget) return i;
+            *budget -= r;
+        }
+        return node->count;
+    }
+
+    size_t base = 0;
+    for (int i = 0; i < node->n; i++) {
+        RopeNode *kid = node->kids[i];
+        size_t c = kid->count;
+        if (base + c <= from) {
+            base += c;
+            continue;
+        }
+        if (from <= base) {
+            size_t r = rope_rows(kid, screen_cols);
+            if (r <= *budget) {
+                *budget -= r;
+                base += c;
+                continue;
+            }
+        }
+        size_t hit = rope_skip_rows(kid, from > base ? from - base : 0, budget, screen_cols);
+        if (hit < c) return base + hit;
+        base += c;
+    }
+    return node->count;
 }
 
-/* ------ screen mapping/render helpers ------- */
-
-// How many terminal columns does this prefix of the
-// line occupy?
-static int visual_width_upto(const Line *l, size_t upto_col) {
-    int width = 0;
-    size_t end = MIN(upto_col, l->len);
-
-    for (size_t i = 0; i < end; i++) {
-        if (l->data[i] == '\t') {
-            int add = TAB_WIDTH - (width % TAB_WIDTH);
-	        width += add;
-	    } else {
-	        width += 1;
-	    }
+// Walks backward from just above line `to`, skipping whole lines
+// while they have fewer rows than *budget. Returns the line the
+// budget runs out in, or SIZE_MAX if it reaches the top first.
+static size_t rope_skip_rows_back(RopeNode *node, size_t to, size_t *budget, int screen_cols) {
+    if (node->leaf) {
+        rope_leaf_expand(node);
+        for (size_t i = to; i-- > 0; ) {
+            size_t r = (size_t)rows_for_width(rope_leaf_width(node, (int)i), screen_cols);
+            if (r >= *budget) return i;
+            *budget -= r;
+        }
+        return SIZE_MAX;
     }
-    return width;
-}
 
-// How many screen rows does a line occupy?
-static int screen_rows_for_line(const Line *l, int screen_cols) {
-    int vwidth = visual_width_upto(l, l->len);
-    return MAX(1, (vwidth + screen_cols - 1) / screen_cols); 
+    size_t base = node->count;
+    for (int i = node->n - 1; i >= 0; i--) {
+        RopeNode *kid = node->kids[i];
+        size_t c = kid->count;
+        base -= c;
+        if (base >= to) continue;
+        if (base + c <= to) {
+            size_t r = rope_rows(kid, screen_cols);
+            if (r < *budget) {
+                *budget -= r;
+                continue;
+            }
+        }
+        size_t hit = rope_skip_rows_back(kid, MIN(to - base, c), budget, screen_cols);
+        if (hit != SIZE_MAX) return base + hit;
+    }
+    return SIZE_MAX;
 }
 
 
 void buffer_to_screen_unclipped(
-        const Buffer *b,
+        Buffer *b,
         size_t target_line,
         size_t target_col,
         const CurrentView *view,
         int screen_cols,
         int *out_row, int *out_col) {
     
-    int row = -(int)view->top_rowoff;
-
     if (target_line < view->top_line) {
         *out_row = -999999;
         *out_col = 0;
         return;
     }
 
-    for (size_t l = view->top_line; l < target_line && l < b->line_count; l++) {
-        row += screen_rows_for_line(&b->lines[l], screen_cols);
+    // Without wrapping every line is one row
+    if (!global_wrap) {
+        *out_row = (int)MIN(target_line - view->top_line, (size_t)999999);
+        *out_col = 0;
+        if (target_line < b->line_count) {
+            Line *cur = buffer_line(b, target_line);
+            int vcol = visual_width_upto(cur, MIN(target_col, cur->len));
+            *out_col = vcol - (int)view->left_col;
+        }
+        return;
     }
 
+    size_t rows = rope_rows_range(b->root, view->top_line, MIN(target_line, b->line_count), screen_cols);
+    int row = (int)MIN(rows, (size_t)999999) - (int)view->top_rowoff;
+
     if (target_line >= b->line_count) {
         *out_row = 999999;
         *out_col = 0;
         return;
     }
 
-    const Line *cur = &b->lines[target_line];
+    Line *cur = buffer_line(b, target_line);
     target_col = MIN(target_col, cur->len);
 
     int vcol = visual_width_upto(cur, target_col);
@@ -775,7 +3774,7 @@ void buffer_to_screen_unclipped(
 }
 
 static bool buffer_to_screen(
-        const Buffer *b,
+        Buffer *b,
         size_t target_line,
         size_t target_col,
         const CurrentView *view,
@@ -791,7 +3790,7 @@ static bool buffer_to_screen(
     return true;
 }
 
-static void view_scroll_by_rows(CurrentView *view, const Buffer *b, int screen_cols, int delta_rows) {
+static void view_scroll_by_rows(CurrentView *view, Buffer *b, int screen_cols, int delta_rows) {
     if (b->line_count == 0) {
         view->top_line = 0;
         view->top_rowoff = 0;
@@ -799,97 +3798,445 @@ static void view_scroll_by_rows(CurrentView *view, const Buffer *b, int screen_c
     }
 
     if (delta_rows > 0) {
-        for (int i = 0; i < delta_rows; i++) {
-            int rows_in_line = screen_rows_for_line(&b->lines[view->top_line], screen_cols);
-            if (view->top_rowoff + 1 < (size_t)rows_in_line) {
-                view->top_rowoff++;
-            } else {
-                if (view->top_line + 1 >= b->line_count) break;
-                view->top_line++;
-                view->top_rowoff = 0;
+        size_t budget = view->top_rowoff + (size_t)delta_rows;
+        size_t line = view->top_line;
+        for (;;) {
+            line = rope_skip_rows(b->root, line, &budget, screen_cols);
+            if (line < b->line_count) {
+                view->top_line = line;
+                view->top_rowoff = budget;
+                return;
             }
+            // Ran off the end of what's indexed so far
+            if (!buffer_has_line(b, line)) break;
         }
+        // Stop on the last row of the last line
+        view->top_line = b->line_count - 1;
+        view->top_rowoff = (size_t)buffer_line_rows(b, view->top_line, screen_cols) - 1;
     } else if (delta_rows < 0) {
-        for (int i = 0; i < -delta_rows; i++) {
-            if (view->top_rowoff > 0) {
-                view->top_rowoff--;
-            } else {
-                if (view->top_line == 0) break;
-                view->top_line--;
-                int rows_in_prev = screen_rows_for_line(&b->lines[view->top_line], screen_cols);
-                view->top_rowoff = (rows_in_prev > 0) ? (size_t)(rows_in_prev - 1) : 0;
-            }
+        size_t up = (size_t)-(long)delta_rows;
+        if (up <= view->top_rowoff) {
+            view->top_rowoff -= up;
+            return;
+        }
+        size_t budget = up - view->top_rowoff;
+        size_t line = rope_skip_rows_back(b->root, view->top_line, &budget, screen_cols);
+        if (line == SIZE_MAX) {
+            view->top_line = 0;
+            view->top_rowoff = 0;
+        } else {
+            view->top_line = line;
+            view->top_rowoff = (size_t)buffer_line_rows(b, line, screen_cols) - budget;
         }
     }
 }
 
+// How many rows the content moved up (negative: down) going from
+// view `from` to `to`, or 0 if it didn't simply move by less than limit
+static int view_shift(const CurrentView *from, const CurrentView *to, Buffer *b, int screen_cols, int limit) {
+    if (from->left_col != to->left_col) return 0;
+
+    bool down = to->top_line > from->top_line ||
+                (to->top_line == from->top_line && to->top_rowoff > from->top_rowoff);
+    const CurrentView *a = down ? from : to;
+    const CurrentView *z = down ? to : from;
+    if (z->top_line - a->top_line >= (size_t)limit) return 0;
+
+    size_t rows = z->top_line - a->top_line;
+    if (global_wrap) rows = rope_rows_range(b->root, a->top_line, MIN(z->top_line, b->line_count), screen_cols);
+    rows = rows + z->top_rowoff - a->top_rowoff;
+    if (rows >= (size_t)limit) return 0;
+    return down ? (int)rows : -(int)rows;
+}
+
 static void editor_scroll_to_cursor(void) {
-    int rows, cols;
-    if (get_window_size(&rows, &cols) == -1) return;
+    int rows = global_rows, cols = global_cols;
+    if (rows < 1 || cols < 1) return;
     int text_rows = rows - 1;
+    int text_cols = editor_text_cols(cols);
+
+    if (!global_wrap) {
+        CurrentView *v = &global_view;
+        if (global_cursor.row < v->top_line) v->top_line = global_cursor.row;
+        else if (text_rows > 0 && global_cursor.row - v->top_line >= (size_t)text_rows) {
+            v->top_line = global_cursor.row - (size_t)text_rows + 1;
+        }
+        v->top_rowoff = 0;
+
+        if (global_cursor.row < global_buffer.line_count) {
+            Line *l = buffer_line(&global_buffer, global_cursor.row);
+            size_t vcol = (size_t)visual_width_upto(l, MIN(global_cursor.col, l->len));
+            if (vcol < v->left_col) v->left_col = vcol;
+            else if (vcol >= v->left_col + (size_t)text_cols) v->left_col = vcol - (size_t)text_cols + 1;
+        }
+        return;
+    }
+
+    // A jump of more lines than the screen has rows lands off screen
+    // however the lines wrap; place the view from the cursor instead
+    // of counting every row in between
+    if (global_cursor.row < global_buffer.line_count &&
+        (global_cursor.row < global_view.top_line ||
+         global_cursor.row - global_view.top_line > (size_t)MAX(text_rows, 0))) {
+        bool above = global_cursor.row < global_view.top_line;
+        Line *l = buffer_line(&global_buffer, global_cursor.row);
+        int vcol = visual_width_upto(l, MIN(global_cursor.col, l->len));
+        global_view.top_line = global_cursor.row;
+        global_view.top_rowoff = (size_t)(vcol / text_cols);
+        if (!above && text_rows > 1) view_scroll_by_rows(&global_view, &global_buffer, text_cols, -(text_rows - 1));
+        return;
+    }
 
     int cr, cc;
-    buffer_to_screen_unclipped(&global_buffer, global_cursor.row, global_cursor.col, &global_view, cols, &cr, &cc);
+    buffer_to_screen_unclipped(&global_buffer, global_cursor.row, global_cursor.col, &global_view, text_cols, &cr, &cc);
     int delta = 0;
     if (cr < 0) delta = cr;
     else if (cr >= text_rows) delta = cr - (text_rows - 1);
 
-    if (delta != 0) view_scroll_by_rows(&global_view, &global_buffer, cols, delta);
+    if (delta != 0) view_scroll_by_rows(&global_view, &global_buffer, text_cols, delta);
+}
+
+/* ----- screen model ----- */
+
+// Unchanged cells shorter than this between two changes are
+// just re-sent; that's cheaper than a cursor jump over them
+#define SCREEN_GAP_MAX 6
+
+// SGR sequence that switches the terminal to each cell attribute,
+// built once from hl_to_ansi() so frames only copy them
+static char attr_sgr[ATTR_COUNT][16];
+static int attr_sgr_len[ATTR_COUNT];
+
+static void attr_sgr_init(void) {
+    for (int a = 0; a < ATTR_COUNT; a++) {
+        int n;
+        if (a == ATTR_STATUS) {
+            n = snprintf(attr_sgr[a], sizeof(attr_sgr[a]), "\x1b[0;7m");
+        } else if (a == ATTR_MATCH) {
+            n = snprintf(attr_sgr[a], sizeof(attr_sgr[a]), "\x1b[0;30;43m");
+        } else if (a == ATTR_GUTTER) {
+            n = snprintf(attr_sgr[a], sizeof(attr_sgr[a]), "\x1b[0;96m");
+        } else {
+            int color = hl_to_ansi((enum Highlight)a);
+            n = (color == 39) ? snprintf(attr_sgr[a], sizeof(attr_sgr[a]), "\x1b[m")
+                              : snprintf(attr_sgr[a], sizeof(attr_sgr[a]), "\x1b[0;%dm", color);
+        }
+        attr_sgr_len[a] = n;
+    }
+}
+
+static void frame_alloc(Screen *s, Frame *f, size_t cells) {
+    char *text = realloc(f->text, cells);
+    unsigned char *attr = realloc(f->attr, cells);
+    if ((!text || !attr) && cells > 0) die("realloc");
+    f->text = text;
+    f->attr = attr;
+    s->allocs += 2;
+}
+
+static void frame_blank(Frame *f, size_t off, size_t n) {
+    memset(f->text + off, ' ', n);
+    memset(f->attr + off, HL_NORMAL, n);
+}
+
+// Writes up to n cells of s into the frame, returns how many fit
+static int frame_put(Frame *f, size_t off, int n, const char *s, int len, unsigned char attr) {
+    int w = MIN(n, len);
+    if (w <= 0) return 0;
+    memcpy(f->text + off, s, (size_t)w);
+    memset(f->attr + off, attr, (size_t)w);
+    return w;
+}
+
+static void screen_resize(Screen *s, int rows, int cols) {
+    if (s->rows == rows && s->cols == cols && s->front.text) return;
+    if (!s->front.text) attr_sgr_init();
+    size_t cells = (size_t)rows * (size_t)cols;
+    frame_alloc(s, &s->front, cells);
+    frame_alloc(s, &s->back, cells);
+    s->rows = rows;
+    s->cols = cols;
+    s->valid = false;
+}
+
+static void screen_free(Screen *s) {
+    free(s->front.text);
+    free(s->front.attr);
+    free(s->back.text);
+    free(s->back.attr);
+    abFree(&s->out);
+}
+
+static void screen_set_attr(Screen *s, struct abuf *ab, int attr) {
+    if (s->sgr == attr) return;
+    abAppend(ab, attr_sgr[attr], attr_sgr_len[attr]);
+    s->sgr = attr;
+}
+
+// Moves the terminal cursor with the shortest sequence
+// we know of from where it currently is
+static void screen_move(Screen *s, struct abuf *ab, int y, int x) {
+    if (s->cy == y && s->cx == x) return;
+
+    if (s->cy == y && s->cx >= 0) {
+        if (x == 0) {
+            abAppend(ab, "\r", 1);
+        } else {
+            abAppend(ab, "\x1b[", 2);
+            abAppendUint(ab, (size_t)(x > s->cx ? x - s->cx : s->cx - x));
+            abAppend(ab, x > s->cx ? "C" : "D", 1);
+        }
+    } else if (x == 0 && s->cy >= 0 && (y == s->cy || y == s->cy + 1)) {
+        abAppend(ab, "\r\n", y == s->cy ? 1 : 2);
+    } else {
+        abAppend(ab, "\x1b[", 2);
+        abAppendUint(ab, (size_t)y + 1);
+        abAppend(ab, ";", 1);
+        abAppendUint(ab, (size_t)x + 1);
+        abAppend(ab, "H", 1);
+    }
+    s->cy = y;
+    s->cx = x;
+}
+
+// Sends cells [x0, x1) of row y from the back frame
+static void screen_emit_run(Screen *s, struct abuf *ab, int y, int x0, int x1) {
+    size_t off = (size_t)y * (size_t)s->cols;
+    const char *text = s->back.text + off;
+    const unsigned char *attr = s->back.attr + off;
+
+    screen_move(s, ab, y, x0);
+    int x = x0;
+    while (x < x1) {
+        int end = x;
+        while (end < x1 && attr[end] == attr[x]) end++;
+        screen_set_attr(s, ab, attr[x]);
+        abAppend(ab, &text[x], end - x);
+        x = end;
+    }
+    // Writing the last column leaves the cursor waiting to wrap
+    s->cx = (x1 >= s->cols) ? -1 : x1;
+}
+
+static bool screen_cell_same(const Screen *s, size_t i) {
+    return s->front.text[i] == s->back.text[i] && s->front.attr[i] == s->back.attr[i];
+}
+
+// Front row fy holds what back row by wants
+static bool screen_row_same(const Screen *s, int fy, int by) {
+    size_t cols = (size_t)s->cols;
+    return memcmp(s->front.text + (size_t)fy * cols, s->back.text + (size_t)by * cols, cols) == 0 &&
+           memcmp(s->front.attr + (size_t)fy * cols, s->back.attr + (size_t)by * cols, cols) == 0;
+}
+
+// Moves rows [0, region) of the terminal up by shift rows (down if
+// negative) with a scroll region, when that leaves more rows right
+// than redrawing them would. The front frame follows along so the
+// diff afterwards only has the exposed rows left to draw.
+static void screen_scroll(Screen *s, struct abuf *ab, int region, int shift) {
+    int n = shift > 0 ? shift : -shift;
+    if (n == 0 || n >= region) return;
+
+    int gain = 0;
+    for (int y = 0; y < region; y++) {
+        int from = y + shift;
+        if (from >= 0 && from < region && screen_row_same(s, from, y)) gain++;
+        if (screen_row_same(s, y, y)) gain--;
+    }
+    if (gain <= 0) return;
+
+    // Rows scrolled in take the current background
+    screen_set_attr(s, ab, HL_NORMAL);
+    abAppend(ab, "\x1b[1;", 4);
+    abAppendUint(ab, (size_t)region);
+    abAppend(ab, "r\x1b[", 3);
+    abAppendUint(ab, (size_t)n);
+    abAppend(ab, shift > 0 ? "S\x1b[r" : "T\x1b[r", 4);
+    // Setting the region homes the cursor
+    s->cy = s->cx = -1;
+
+    size_t cols = (size_t)s->cols;
+    size_t keep = (size_t)(region - n) * cols;
+    size_t moved = (size_t)n * cols;
+    if (shift > 0) {
+        memmove(s->front.text, s->front.text + moved, keep);
+        memmove(s->front.attr, s->front.attr + moved, keep);
+        frame_blank(&s->front, keep, moved);
+    } else {
+        memmove(s->front.text + moved, s->front.text, keep);
+        memmove(s->front.attr + moved, s->front.attr, keep);
+        frame_blank(&s->front, 0, moved);
+    }
+}
+
+static void screen_flush_row(Screen *s, struct abuf *ab, int y) {
+    int cols = s->cols;
+    size_t off = (size_t)y * (size_t)cols;
+    if (memcmp(s->front.text + off, s->back.text + off, (size_t)cols) == 0 &&
+        memcmp(s->front.attr + off, s->back.attr + off, (size_t)cols) == 0) return;
+
+    // Everything from blank_from on is empty, so it can be
+    // cleared with one EL instead of being written out
+    int blank_from = cols;
+    while (blank_from > 0 && s->back.text[off + blank_from - 1] == ' ' &&
+           s->back.attr[off + blank_from - 1] == HL_NORMAL) blank_from--;
+
+    int x = 0;
+    while (x < cols) {
+        if (screen_cell_same(s, off + x)) {
+            x++;
+            continue;
+        }
+
+        int start = x, end = x + 1;
+        for (int probe = end; probe < cols && probe - end < SCREEN_GAP_MAX; probe++) {
+            if (!screen_cell_same(s, off + probe)) end = probe + 1;
+        }
+
+        if (end > blank_from) {
+            if (start < blank_from) screen_emit_run(s, ab, y, start, blank_from);
+            else screen_move(s, ab, y, start);
+            if (s->sgr != HL_NORMAL) screen_set_attr(s, ab, HL_NORMAL);
+            abAppend(ab, "\x1b[K", 3);
+            break;
+        }
+        screen_emit_run(s, ab, y, start, end);
+        x = end;
+    }
+}
+
+// Writes out the difference between the back frame and what's
+// on the terminal, leaves the cursor at (cur_y, cur_x) and makes
+// the back frame the new front. The top `region` rows are first
+// scrolled by `shift` if the view moved that far.
+static void screen_flush(Screen *s, int cur_y, int cur_x, int region, int shift) {
+    struct abuf *ab = &s->out;
+    abClear(ab);
+
+    // Frames are sent as one synchronized update and the cursor
+    // is hidden while cells are being written, if any are
+    abAppend(ab, "\x1b[?2026h\x1b[?25l", 14);
+    int hide_len = ab->len;
+
+    if (!s->valid) {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        frame_blank(&s->front, 0, (size_t)s->rows * (size_t)s->cols);
+        s->sgr = HL_NORMAL;
+        s->cy = s->cx = -1;
+        s->valid = true;
+    } else {
+        screen_scroll(s, ab, region, shift);
+    }
+
+    for (int y = 0; y < s->rows; y++) screen_flush_row(s, ab, y);
+
+    bool drew = ab->len > hide_len;
+    screen_move(s, ab, cur_y, cur_x);
+    if (drew) abAppend(ab, "\x1b[?25h\x1b[?2026l", 14);
+
+    int skip = drew ? 0 : hide_len;
+    if (ab->len > skip) write(STDOUT_FILENO, ab->b + skip, (size_t)(ab->len - skip));
+    s->frame_bytes = (size_t)(ab->len - skip);
+
+    Frame tmp = s->front;
+    s->front = s->back;
+    s->back = tmp;
 }
 
 /* ----- rendering ----- */
 
-static void editor_append_wrapped_slice_hl(struct abuf *ab, const Line *l, int text_cols, size_t wrap_row) {
-    int start_v = (int)(wrap_row * (size_t)text_cols);
-    int end_v   = start_v + text_cols;
+// Index of the first span that ends after byte i
+static size_t hl_span_find(const HlSpan *sp, size_t n, size_t i) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((size_t)sp[mid].start + sp[mid].len <= i) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-    int v = 0;
-    int cur_color = 39;
+// Draws display columns [start_v, start_v + width) of a line into
+// n cells at off, blank-filling whatever the line doesn't reach
+static void editor_draw_line_cols(Frame *f, size_t off, int n, Line *l, bool hl_ok, int start_v, int width) {
+    int end_v   = start_v + MIN(n, width);
+
+    int v;
+    int x = 0;
+    size_t i = line_offset_at_width(l, start_v, &v);
+    const HlSpan *sp = line_hl_spans(l);
+    size_t ns = hl_ok ? l->hl_n : 0;
+    size_t k = hl_span_find(sp, ns, i);
+
+    // Search matches are drawn over the highlighting; start with
+    // the first one that reaches i. Every byte takes at least a
+    // column, so only matches starting before i + (end_v - v) can
+    // show, and the search never has to look further than that.
+    const Search *s = &global_search;
+    size_t m_start = SIZE_MAX, m_end = SIZE_MAX;
+    size_t m_len = 0;
+    if (s->show && s->len > 0) {
+        m_len = MIN(l->len, i + (size_t)MAX(end_v - v, 0) + s->len - 1);
+        m_start = search_find(s, l->data, m_len, i >= s->len ? i - s->len + 1 : 0);
+        if (m_start != SIZE_MAX) m_end = m_start + s->len;
+    }
 
-    for (size_t i = 0; i < l->len; i++) {
-        unsigned char hl = (l->hl && i < l->len) ? l->hl[i] : HL_NORMAL;
-        int color = hl_to_ansi((enum Highlight)hl);
+    while (i < l->len && v < end_v) {
+        // The stretch from i that's all one colour
+        while (k < ns && (size_t)sp[k].start + sp[k].len <= i) k++;
+        unsigned char hl = HL_NORMAL;
+        size_t run_end = l->len;
+        if (k < ns && sp[k].start <= i) {
+            hl = sp[k].hl;
+            run_end = MIN(run_end, (size_t)sp[k].start + sp[k].len);
+        } else if (k < ns) {
+            run_end = sp[k].start;
+        }
 
-        if (l->data[i] == '\t') {
-            int spaces = TAB_WIDTH - (v % TAB_WIDTH);
-            for (int s = 0; s < spaces; s++) {
-                if (v >= start_v && v < end_v) {
-                    if (color != cur_color) {
-                        char buf[16];
-                        int n = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, n);
-                        cur_color = color;
-                    }
-                    abAppend(ab, " ", 1);
-                }
-                v++;
-                if (v >= end_v) goto done;
-            }
+        if (m_end <= i) {
+            m_start = search_find(s, l->data, m_len, m_end);
+            m_end = (m_start != SIZE_MAX) ? m_start + s->len : SIZE_MAX;
+        }
+        if (m_start <= i) {
+            hl = ATTR_MATCH;
+            run_end = MIN(run_end, m_end);
         } else {
-            if (v >= start_v && v < end_v) {
-                if (color != cur_color) {
-                    char buf[16];
-                    int n = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                    abAppend(ab, buf, n);
-                    cur_color = color;
+            run_end = MIN(run_end, m_start);
+        }
+
+        while (i < run_end && v < end_v) {
+            if (l->data[i] == '\t') {
+                int spaces = TAB_WIDTH - (v % TAB_WIDTH);
+                for (int s = 0; s < spaces && v < end_v; s++, v++) {
+                    if (v >= start_v) {
+                        f->text[off + x] = ' ';
+                        f->attr[off + x] = hl;
+                        x++;
+                    }
                 }
-                abAppend(ab, &l->data[i], 1);
+                i++;
+                continue;
             }
-            v++;
-            if (v >= end_v) break;
+            // Up to the next tab it's one copy
+            const char *tab = memchr(&l->data[i], '\t', run_end - i);
+            size_t stop = tab ? (size_t)(tab - l->data) : run_end;
+            size_t cnt = MIN(stop - i, (size_t)(end_v - v));
+            memcpy(f->text + off + x, &l->data[i], cnt);
+            memset(f->attr + off + x, hl, cnt);
+            x += (int)cnt;
+            v += (int)cnt;
+            i += cnt;
         }
     }
-
-done:
-    if (cur_color != 39) abAppend(ab, "\x1b[39m", 5); // reset to default fg
+    if (x < n) frame_blank(f, off + x, (size_t)(n - x));
 }
 
-static void editor_append_wrapped_slice(struct abuf *ab, const Line *l, int screen_cols, size_t wrap_row) {
+static void editor_append_wrapped_slice(struct abuf *ab, Line *l, int screen_cols, size_t wrap_row) {
     int start_v = (int)(wrap_row * (size_t)screen_cols);
     int end_v = start_v + screen_cols;
 
-    int v = 0;
-    for (size_t i = 0; i < l->len; i++) {
+    int v;
+    for (size_t i = line_offset_at_width(l, start_v, &v); i < l->len; i++) {
         char ch = l->data[i];
 
         if (ch == '\t') {
@@ -907,71 +4254,54 @@ static void editor_append_wrapped_slice(struct abuf *ab, const Line *l, int scre
     }
 }
 
-static void editor_draw_rows(struct abuf *ab, int text_rows, int text_cols, int lnw) {
+static void editor_draw_rows(Frame *f, int cols, int text_rows, int text_cols, int lnw) {
     size_t line_idx = global_view.top_line;
     size_t rowoff = global_view.top_rowoff;
+    int gutter = lnw + 2;
 
     for (int y = 0; y < text_rows; y++) {
+        size_t off = (size_t)y * (size_t)cols;
 
-        bool has_line = (line_idx < global_buffer.line_count);
+        bool has_line = buffer_has_line(&global_buffer, line_idx);
         bool first_wrap = (rowoff == 0);
 
-        char nb[64];
+        char nb[24];
+        memset(nb, ' ', (size_t)gutter);
         if (has_line && first_wrap) {
-            snprintf(nb, sizeof(nb), "%*zu", lnw, line_idx + 1);
-        } else {
-            snprintf(nb, sizeof(nb), "%*s", lnw, "");
+            size_t num = line_idx + 1;
+            format_uint(nb + lnw - digits_size_t(num), num);
         }
-
-        abAppend(ab, "\x1b[96m", 5);
-        abAppend(ab, nb, (int)strlen(nb));
-        abAppend(ab, "  ", 2);
-        abAppend(ab, "\x1b[39m", 5);
+        int x = frame_put(f, off, cols, nb, gutter, ATTR_GUTTER);
 
         if (!has_line) {
-            abAppend(ab, "~", 1);
+            x += frame_put(f, off + x, cols - x, "~", 1, HL_NORMAL);
+            frame_blank(f, off + x, (size_t)(cols - x));
         } else {
-            Line *l = &global_buffer.lines[line_idx];
-            editor_append_wrapped_slice_hl(ab, l, text_cols, rowoff);
+            Line *l = buffer_line(&global_buffer, line_idx);
+            bool hl_ok = *buffer_hl_state(&global_buffer, line_idx) & HLS_OK;
+            if (!global_wrap) {
+                if (x < cols) editor_draw_line_cols(f, off + x, cols - x, l, hl_ok, (int)global_view.left_col, cols - x);
+                line_idx++;
+                continue;
+            }
+            if (x < cols) editor_draw_line_cols(f, off + x, cols - x, l, hl_ok, (int)(rowoff * (size_t)text_cols), text_cols);
 
-            int rows_in_line = screen_rows_for_line(l, text_cols);
+            int rows_in_line = buffer_line_rows(&global_buffer, line_idx, text_cols);
             if (rowoff + 1 < (size_t)rows_in_line) {
                 rowoff++; 
             } else { 
                 line_idx++; rowoff = 0;
             }
         }
-
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
-
-        // if (line_idx >= global_buffer.line_count) {
-        //     abAppend(ab, "~", 1);
-        // } else {
-        //     Line *l = &global_buffer.lines[line_idx];
-        
-        //     editor_append_wrapped_slice_hl(ab, l, screen_cols, rowoff);
-
-        //     int rows_in_line = screen_rows_for_line(l, screen_cols);
-        //     if (rowoff + 1 < (size_t)rows_in_line) {
-        //         rowoff++;
-        //     } else {
-        //         line_idx++;
-        //         rowoff = 0;
-        //     }
-        // } 
-        
-        // abAppend(ab, "\x1b[K", 3);
-        // abAppend(ab, "\r\n", 2);
     }
 }
 
-static void editor_draw_status_bar(struct abuf *ab, int screen_cols) {
+static void editor_draw_status_bar(Frame *f, size_t off, int screen_cols) {
     char left[256];
     left[0] = '\0';
 
     if (global_mode == COMMAND) {
-        snprintf(left, sizeof(left), ":%s", global_cmd);
+        snprintf(left, sizeof(left), "%c%s", global_cmd_prompt, global_cmd);
     } else if (global_status[0] != '\0') {
         snprintf(left, sizeof(left), "%s", global_status);
     } else {
@@ -987,63 +4317,280 @@ static void editor_draw_status_bar(struct abuf *ab, int screen_cols) {
                 global_control_char);
     }
 
-    abAppend(ab, "\x1b[7m", 4);
-    int len = (int)strlen(left);
-    if (len > screen_cols) len = screen_cols;
-    abAppend(ab, left, len);
-    while (len < screen_cols) {
-        abAppend(ab, " ", 1);
-        len++;
-    }
-    abAppend(ab, "\x1b[m", 3);
+    int len = frame_put(f, off, screen_cols, left, (int)strlen(left), ATTR_STATUS);
+    memset(f->text + off + len, ' ', (size_t)(screen_cols - len));
+    memset(f->attr + off + len, ATTR_STATUS, (size_t)(screen_cols - len));
 }
 
 static void editor_refresh_screen(void) {
     editor_scroll_to_cursor();
 
-    int rows, cols;
-    if (get_window_size(&rows, &cols) == -1) return;
+    int rows = global_rows, cols = global_cols;
+    if (rows < 1 || cols < 1) return;
 
     int lnw = digits_size_t(global_buffer.line_count); // number width
-    int gutter = lnw + 2; // " " + "|" (or " |")
-    int text_cols = cols - gutter;
-    if (text_cols < 1) text_cols = 1;
-
+    int text_cols = editor_text_cols(cols);
     int text_rows = rows - 1;
-    if (text_rows < 1) text_rows = 1;
 
-    struct abuf ab = ABUF_INIT;
+    // Every row on screen is at least one line
+    editor_syntax_view(global_view.top_line, global_view.top_line + (size_t)text_rows + HL_MARGIN);
+
+    int shift = 0;
+    if (drawn_text_cols == text_cols && drawn_wrap == global_wrap) {
+        shift = view_shift(&drawn_view, &global_view, &global_buffer, text_cols, text_rows);
+    }
+    drawn_view = global_view;
+    drawn_text_cols = text_cols;
+    drawn_wrap = global_wrap;
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
+    Screen *s = &global_screen;
+    unsigned long allocs = s->allocs + s->out.allocs;
+    screen_resize(s, rows, cols);
 
-    editor_draw_rows(&ab, text_rows, cols, lnw);
-    editor_draw_status_bar(&ab, cols);
+    editor_draw_rows(&s->back, cols, text_rows, text_cols, lnw);
+    editor_draw_status_bar(&s->back, (size_t)text_rows * (size_t)cols, cols);
 
     int r = 0, c = 0;
-    if (!buffer_to_screen(&global_buffer, global_cursor.row, global_cursor.col, &global_view, cols, text_rows, &r, &c)) {
+    if (!buffer_to_screen(&global_buffer, global_cursor.row, global_cursor.col, &global_view, text_cols, text_rows, &r, &c)) {
         r = 0;
         c = 0;
     }
 
     c += (lnw + 2);
+    if (c >= cols) c = cols - 1;
+
+    screen_flush(s, r, c, text_rows, shift);
+    s->frame_allocs = s->allocs + s->out.allocs - allocs;
+
+    frame_pending = false;
+    clock_gettime(CLOCK_MONOTONIC, &last_frame_time);
+}
+
+/* ----- undo ------- */
+
+#define UNDO_FOOTER sizeof(size_t)
+
+static UndoOp undo_op_at(const UndoLog *u, size_t off) {
+    UndoOp op;
+    memcpy(&op, u->log + off, sizeof(op));
+    return op;
+}
+
+// Offset of the op that ends at off
+static size_t undo_op_before(const UndoLog *u, size_t off) {
+    size_t size;
+    memcpy(&size, u->log + off - UNDO_FOOTER, UNDO_FOOTER);
+    return off - UNDO_FOOTER - size;
+}
+
+static void undo_reserve(UndoLog *u, size_t extra) {
+    if (u->len + extra <= u->cap) return;
+    size_t cap = u->cap ? u->cap : 4096;
+    while (cap < u->len + extra) cap *= 2;
+    u->log = realloc(u->log, cap);
+    if (!u->log) die("realloc");
+    u->cap = cap;
+}
+
+// Rewrites the newest op's header and footer after its text changed.
+static void undo_seal(UndoLog *u, const UndoOp *op) {
+    size_t size = sizeof(UndoOp) + op->len;
+    memcpy(u->log + u->last, op, sizeof(UndoOp));
+    memcpy(u->log + u->last + size, &size, UNDO_FOOTER);
+    u->len = u->last + size + UNDO_FOOTER;
+    u->pos = u->len;
+}
+
+// Moves (row, col) to just past text s.
+static void text_advance(size_t *row, size_t *col, const char *s, size_t n) {
+    const char *nl;
+    const char *end = s + n;
+    while ((nl = memchr(s, '\n', (size_t)(end - s)))) {
+        (*row)++;
+        *col = 0;
+        s = nl + 1;
+    }
+    *col += (size_t)(end - s);
+}
+
+// Drops the oldest whole steps until the log is back under three
+// quarters of its limit, so it isn't done again every keystroke.
+// Only called between steps.
+static void undo_trim(UndoLog *u) {
+    if (u->len <= u->limit) return;
+
+    size_t want = u->len - u->limit / 4 * 3;
+    size_t cut = 0;
+    while (cut < u->len && (cut < want || !undo_op_at(u, cut).group)) {
+        cut += sizeof(UndoOp) + undo_op_at(u, cut).len + UNDO_FOOTER;
+    }
+    memmove(u->log, u->log + cut, u->len - cut);
+    u->len -= cut;
+    u->pos -= cut;
+    u->last = (u->last != SIZE_MAX && u->last >= cut) ? u->last - cut : SIZE_MAX;
+}
+
+// Next op starts a new undo step.
+static void undo_break(UndoLog *u) {
+    u->new_group = true;
+}
+
+// Gives up on the step being recorded: keeping it would cost more
+// than the whole log may, and earlier steps can't be undone across
+// it either.
+static void undo_lose(UndoLog *u) {
+    u->len = u->pos = 0;
+    u->last = SIZE_MAX;
+    u->lost = true;
+    u->new_group = false;
+    snprintf(global_status, sizeof(global_status), "Change too big to undo");
+}
+
+// Makes room under the limit for n more bytes of the step being
+// recorded, first by dropping the steps before it, then by losing it.
+// Returns false if it was lost.
+static bool undo_fit(UndoLog *u, size_t n) {
+    if (u->len + n <= u->limit) return true;
+
+    size_t start = u->last;
+    while (start > 0 && !undo_op_at(u, start).group) start = undo_op_before(u, start);
+    if (start > 0) {
+        memmove(u->log, u->log + start, u->len - start);
+        u->len -= start;
+        u->pos -= start;
+        u->last -= start;
+    }
+    if (u->len + n <= u->limit) return true;
+    undo_lose(u);
+    return false;
+}
+
+// Appends n more bytes to the end of the newest op's text.
+static void undo_extend(UndoLog *u, const char *s, size_t n) {
+    if (u->lost || u->last == SIZE_MAX || n == 0) return;
+    if (!undo_fit(u, n)) return;
+    UndoOp op = undo_op_at(u, u->last);
+    undo_reserve(u, n);
+    memcpy(u->log + u->last + sizeof(UndoOp) + op.len, s, n);
+    op.len += n;
+    undo_seal(u, &op);
+    text_advance(&u->end_row, &u->end_col, s, n);
+}
+
+// Folds a backspace into the newest op, if it can: either it takes
+// back what was just typed, or it deletes right before the last
+// deletion.
+static bool undo_coalesce_delete(UndoLog *u, size_t row, size_t col, const char *s, size_t n) {
+    UndoOp op = undo_op_at(u, u->last);
+    char *text = u->log + u->last + sizeof(UndoOp);
+    size_t end_row = row, end_col = col;
+    text_advance(&end_row, &end_col, s, n);
+
+    if (op.kind == UNDO_INSERT) {
+        if (end_row != u->end_row || end_col != u->end_col || n > op.len) return false;
+        if (memcmp(text + op.len - n, s, n) != 0) return false;
+        op.len -= n;
+        u->end_row = row;
+        u->end_col = col;
+        if (op.len > 0 || !op.group) {
+            undo_seal(u, &op);
+            return true;
+        }
+        // Nothing left of the step
+        u->len = u->pos = u->last;
+        u->last = u->last > 0 ? undo_op_before(u, u->last) : SIZE_MAX;
+        u->new_group = true;
+        return true;
+    }
+
+    if (end_row != op.row || end_col != op.col || op.len + n > UNDO_COALESCE_MAX) return false;
+    if (!undo_fit(u, n)) return true;
+    undo_reserve(u, n);
+    text = u->log + u->last + sizeof(UndoOp);
+    memmove(text + n, text, op.len);
+    memcpy(text, s, n);
+    op.len += n;
+    op.row = row;
+    op.col = col;
+    undo_seal(u, &op);
+    return true;
+}
+
+// Records that text s went in at (row, col), or is about to be
+// taken out from there. Typing carries on the newest op where it
+// can, rather than starting another.
+static void undo_record(UndoLog *u, enum UndoKind kind, size_t row, size_t col, const char *s, size_t n) {
+    if (u->new_group) u->lost = false;
+    else if (u->lost) return;
+
+    // A new edit makes whatever was undone unreachable
+    if (u->pos < u->len) {
+        u->len = u->pos;
+        u->last = SIZE_MAX;
+    }
+
+    if (!u->new_group && u->last != SIZE_MAX) {
+        if (kind == UNDO_INSERT && undo_op_at(u, u->last).kind == UNDO_INSERT &&
+            row == u->end_row && col == u->end_col) {
+            undo_extend(u, s, n);
+            return;
+        }
+        if (kind == UNDO_DELETE && undo_coalesce_delete(u, row, col, s, n)) return;
+    }
+
+    if (u->new_group) undo_trim(u);
+    if (n > u->limit) {
+        undo_lose(u);
+        return;
+    }
 
-    char buf[32];
-    int n = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", r + 1, c + 1);
-    abAppend(&ab, buf, n);
-    abAppend(&ab, "\x1b[?25h", 6);
+    UndoOp op = { .row = row, .col = col, .len = 0, .kind = (unsigned char)kind, .group = u->new_group };
+    undo_reserve(u, sizeof(UndoOp) + UNDO_FOOTER);
+    u->last = u->len;
+    undo_seal(u, &op);
+    u->new_group = false;
+    u->end_row = row;
+    u->end_col = col;
+    undo_extend(u, s, n);
+}
+
+// Carries op out on the buffer, or its inverse when undoing.
+static void undo_apply(Buffer *b, const UndoLog *u, size_t off, bool undo) {
+    UndoOp op = undo_op_at(u, off);
+    const char *text = u->log + off + sizeof(UndoOp);
+    if ((op.kind == UNDO_INSERT) != undo) {
+        Cursor c = { op.row, op.col };
+        buffer_insert_text(b, &c, text, op.len);
+        journal_append(UNDO_INSERT, op.row, op.col, text, op.len);
+    } else {
+        buffer_delete_text(b, op.row, op.col, op.len);
+        journal_append(UNDO_DELETE, op.row, op.col, text, op.len);
+    }
+}
 
-    write(STDOUT_FILENO, ab.b, (size_t)ab.len);
-    abFree(&ab);
+static void undo_free(UndoLog *u) {
+    free(u->log);
+    memset(u, 0, sizeof(*u));
 }
 
 /* ----- editing operations ------- */
 
+static void editor_mark_dirty(void) {
+    global_dirty = true;
+    global_edit_seq++;
+}
+
+// Notes an edit about to be made at the cursor, for undo and the journal.
+static void editor_record_edit(enum UndoKind kind, size_t row, size_t col, const char *s, size_t n) {
+    undo_record(&global_undo, kind, row, col, s, n);
+    journal_append(kind, row, col, s, n);
+}
+
 static void editor_move_cursor(int key) {
     if (global_buffer.line_count == 0) return;
     if (global_cursor.row >= global_buffer.line_count) global_cursor.row = global_buffer.line_count - 1;
 
-    Line *line = &global_buffer.lines[global_cursor.row];
+    Line *line = buffer_line(&global_buffer, global_cursor.row);
 
     switch (key) {
         case ARROW_LEFT:
@@ -1051,14 +4598,14 @@ static void editor_move_cursor(int key) {
                 global_cursor.col--;
             } else if (global_cursor.row > 0) {
                 global_cursor.row--;
-                global_cursor.col = global_buffer.lines[global_cursor.row].len;
+                global_cursor.col = buffer_line(&global_buffer, global_cursor.row)->len;
             }
             break;
         
         case ARROW_RIGHT:
             if (global_cursor.col < line->len) {
                 global_cursor.col++;
-            } else if (global_cursor.row + 1 < global_buffer.line_count) {
+            } else if (buffer_has_line(&global_buffer, global_cursor.row + 1)) {
                 global_cursor.row++;
                 global_cursor.col = 0;
             }
@@ -1069,11 +4616,11 @@ static void editor_move_cursor(int key) {
             break;
 
         case ARROW_DOWN:
-            if (global_cursor.row + 1 < global_buffer.line_count) global_cursor.row++;
+            if (buffer_has_line(&global_buffer, global_cursor.row + 1)) global_cursor.row++;
             break;
     }
 
-    line = &global_buffer.lines[global_cursor.row];
+    line = buffer_line(&global_buffer, global_cursor.row);
     if (global_cursor.col > line->len) global_cursor.col = line->len;
 
     //editor_scroll_to_cursor();
@@ -1082,38 +4629,119 @@ static void editor_move_cursor(int key) {
 
 static void editor_insert_char(char c) {
     if (global_cursor.row >= global_buffer.line_count) return;
-    Line *l = &global_buffer.lines[global_cursor.row];
+    Line *l = buffer_line(&global_buffer, global_cursor.row);
     global_cursor.col = MIN(global_cursor.col, l->len);
-    line_insert_char(l, global_cursor.col, c);
+    editor_record_edit(UNDO_INSERT, global_cursor.row, global_cursor.col, &c, 1);
+    line_insert_char(&global_buffer.pool, l, global_cursor.col, c);
+    buffer_line_changed(&global_buffer, global_cursor.row);
     global_cursor.col++;
-    global_dirty = true;
-    editor_update_syntax_from(global_cursor.row);
+    editor_mark_dirty();
 }
 
 static void editor_insert_newline(void) {
-    size_t start = global_cursor.row;
+    if (global_cursor.row >= global_buffer.line_count) return;
+    Line *l = buffer_line(&global_buffer, global_cursor.row);
+    editor_record_edit(UNDO_INSERT, global_cursor.row, MIN(global_cursor.col, l->len), "\n", 1);
     buffer_split_line(&global_buffer, &global_cursor);
-    global_dirty = true;
-    editor_update_syntax_from(start);
+    editor_mark_dirty();
 }
 
 static void editor_backspace(void) {
     if (global_cursor.row >= global_buffer.line_count) return;
 
     if (global_cursor.col > 0) {
-        Line *l = &global_buffer.lines[global_cursor.row];
-        line_delete_char(l, global_cursor.col - 1);
+        Line *l = buffer_line(&global_buffer, global_cursor.row);
+        if (global_cursor.col <= l->len) {
+            editor_record_edit(UNDO_DELETE, global_cursor.row, global_cursor.col - 1, &l->data[global_cursor.col - 1], 1);
+        }
+        line_delete_char(&global_buffer.pool, l, global_cursor.col - 1);
+        buffer_line_changed(&global_buffer, global_cursor.row);
         global_cursor.col--;
-        global_dirty = true;
-        editor_update_syntax_from(global_cursor.row > 0 ? global_cursor.row - 1 : 0);
+        editor_mark_dirty();
         return;
     }
 
     if (global_cursor.row > 0) {
+        Line *prev = buffer_line(&global_buffer, global_cursor.row - 1);
+        editor_record_edit(UNDO_DELETE, global_cursor.row - 1, prev->len, "\n", 1);
         buffer_join_line_with_prev(&global_buffer, &global_cursor);
-        global_dirty = true;
-        editor_update_syntax_from(global_cursor.row > 0 ? global_cursor.row - 1 : 0);
+        editor_mark_dirty();
+    }
+}
+
+// Deletes the cursor's line, newline and all.
+static void editor_delete_line(void) {
+    Buffer *b = &global_buffer;
+    size_t row = global_cursor.row;
+    if (row >= b->line_count) return;
+
+    bool has_next = buffer_has_line(b, row + 1);
+    Line *l = buffer_line(b, row);
+    if (has_next) {
+        undo_record(&global_undo, UNDO_DELETE, row, 0, l->data, l->len);
+        undo_extend(&global_undo, "\n", 1);
+        // The journal has no extend, so it gets the two halves in turn
+        journal_append(UNDO_DELETE, row, 0, l->data, l->len);
+        journal_append(UNDO_DELETE, row, 0, "\n", 1);
+    } else if (row > 0) {
+        Line *prev = buffer_line(b, row - 1);
+        size_t at = prev->len;
+        undo_record(&global_undo, UNDO_DELETE, row - 1, at, "\n", 1);
+        l = buffer_line(b, row);
+        undo_extend(&global_undo, l->data, l->len);
+        journal_append(UNDO_DELETE, row - 1, at, "\n", 1);
+        journal_append(UNDO_DELETE, row - 1, at, l->data, l->len);
+    } else if (l->len > 0) {
+        // The last line left only gets emptied
+        editor_record_edit(UNDO_DELETE, 0, 0, l->data, l->len);
+    }
+    buffer_delete_line(b, row);
+    // Off the end, the cursor goes up to the new last line
+    if (global_cursor.row >= b->line_count) global_cursor.row = b->line_count - 1;
+    global_cursor.col = MIN(global_cursor.col, buffer_line(b, global_cursor.row)->len);
+    editor_mark_dirty();
+}
+
+// Undoes the newest step, leaving the cursor where it started.
+static void editor_undo(void) {
+    UndoLog *u = &global_undo;
+    if (u->pos == 0) {
+        snprintf(global_status, sizeof(global_status), "Already at oldest change");
+        return;
+    }
+
+    UndoOp op;
+    do {
+        u->pos = undo_op_before(u, u->pos);
+        undo_apply(&global_buffer, u, u->pos, true);
+        op = undo_op_at(u, u->pos);
+    } while (!op.group && u->pos > 0);
+
+    undo_break(u);
+    global_cursor.row = op.row;
+    global_cursor.col = op.col;
+    editor_mark_dirty();
+}
+
+// Does the next undone step again.
+static void editor_redo(void) {
+    UndoLog *u = &global_undo;
+    if (u->pos == u->len) {
+        snprintf(global_status, sizeof(global_status), "Already at newest change");
+        return;
     }
+
+    UndoOp op;
+    do {
+        op = undo_op_at(u, u->pos);
+        undo_apply(&global_buffer, u, u->pos, false);
+        u->pos += sizeof(UndoOp) + op.len + UNDO_FOOTER;
+    } while (u->pos < u->len && !undo_op_at(u, u->pos).group);
+
+    undo_break(u);
+    global_cursor.row = op.row;
+    global_cursor.col = op.col;
+    editor_mark_dirty();
 }
 
 // static void editor_backspace(void) {
@@ -1136,8 +4764,9 @@ static void editor_backspace(void) {
 
 /* ------ command mode ------ */
 
-static void editor_enter_command_mode(void) {
+static void editor_enter_command_mode(char prompt) {
     global_mode = COMMAND;
+    global_cmd_prompt = prompt;
     global_cmd_len = 0;
     global_cmd[0] = '\0';
 }
@@ -1163,29 +4792,63 @@ static void editor_execute_command(void) {
     } else if (strcmp(cmd, "q!") == 0) {
         editor_running = false;
     } else if (strcmp(cmd, "w") == 0) {
-        dump_buffer_to_file(&global_buffer, global_filename);
+        editor_save_in_background(global_filename);
     } else if (strncmp(cmd, "w ", 2) == 0) {
         cmd += 2;
         while (*cmd == ' ') cmd++;
         if (*cmd == '\0') {
             snprintf(global_status, sizeof(global_status), "Usage: :w <path>");
         } else {
-            free(global_filename_owned);
-            global_filename_owned = strdup(cmd);
-            if (!global_filename_owned) die("strdup");
-            global_filename = global_filename_owned;
-            dump_buffer_to_file(&global_buffer, global_filename);
+            // The buffer only takes the new name once it's being written there
+            char *path = strdup(cmd);
+            if (!path) die("strdup");
+            if (editor_save_in_background(path)) {
+                free(global_filename_owned);
+                global_filename_owned = path;
+                global_filename = path;
+                editor_select_syntax();
+            } else {
+                free(path);
+            }
         }
     } else if (strcmp(cmd, "wq") == 0) {
+        // Quitting anyway, so just wait for it
+        editor_poll_save(true);
         if (dump_buffer_to_file(&global_buffer, global_filename) == 0) {
             editor_running = false;
         }
+    } else if (strcmp(cmd, "noh") == 0 || strcmp(cmd, "nohlsearch") == 0) {
+        global_search.show = false;
+    } else if (strcmp(cmd, "stats") == 0) {
+        Screen *s = &global_screen;
+        snprintf(global_status, sizeof(global_status),
+                 "Last frame: %zu bytes, %lu allocations (%lu since start), %lu journal syncs",
+                 s->frame_bytes, s->frame_allocs, s->allocs + s->out.allocs, journal_syncs());
+    } else if (strncmp(cmd, "set ", 4) == 0) {
+        cmd += 4;
+        while (*cmd == ' ') cmd++;
+        if (strcmp(cmd, "wrap") == 0) {
+            global_wrap = true;
+            global_view.left_col = 0;
+        } else if (strcmp(cmd, "nowrap") == 0) {
+            global_wrap = false;
+            global_view.top_rowoff = 0;
+        } else if (strncmp(cmd, "frametime=", 10) == 0 && isdigit((unsigned char)cmd[10])) {
+            global_frame_ms = atoi(cmd + 10);
+        } else if (strncmp(cmd, "undomem=", 8) == 0 && isdigit((unsigned char)cmd[8])) {
+            // Takes effect from the next step on
+            global_undo.limit = (size_t)atol(cmd + 8) << 20;
+        } else {
+            snprintf(global_status, sizeof(global_status), "Unknown option: %s", cmd);
+        }
 	} else {
 		char *endptr;
 		strtol(cmd, &endptr, 10);
 
 		if (*endptr == '\0') {
-			global_cursor.row = atoi(cmd);
+			long target = atol(cmd);
+			if (target > 0) buffer_has_line(&global_buffer, (size_t)target);
+			global_cursor.row = (target > 0) ? MIN((size_t)target, global_buffer.line_count - 1) : 0;
 			global_cursor.col = 1;
             editor_refresh_screen();
 		} else {
@@ -1196,19 +4859,95 @@ static void editor_execute_command(void) {
     editor_leave_command_mode();
 }
 
+/* ------ search prompt ------ */
+
+static void editor_search_start(char prompt) {
+    search_saved = global_search;
+    search_origin = global_cursor;
+    editor_enter_command_mode(prompt);
+}
+
+// Puts the cursor on the first match of what's been typed so far,
+// counting from where it was when the prompt opened.
+static bool editor_search_update(void) {
+    Search *s = &global_search;
+    search_set(s, global_cmd, global_cmd_len);
+    s->backward = (global_cmd_prompt == '?');
+    s->show = true;
+
+    Cursor at = search_origin;
+    bool wrapped;
+    bool found = buffer_search(&global_buffer, s, &at, s->backward, &wrapped);
+    global_cursor = found ? at : search_origin;
+    return found;
+}
+
+static void editor_search_cancel(void) {
+    global_search = search_saved;
+    global_cursor = search_origin;
+    editor_leave_command_mode();
+}
+
+// Goes to the next match of the last search, the way it went or,
+// with reverse, the other way.
+static void editor_search_next(bool reverse) {
+    Search *s = &global_search;
+    if (s->len == 0) {
+        snprintf(global_status, sizeof(global_status), "No previous search");
+        return;
+    }
+
+    bool backward = (s->backward != reverse);
+    Cursor at = global_cursor;
+    bool wrapped;
+    s->show = true;
+    if (!buffer_search(&global_buffer, s, &at, backward, &wrapped)) {
+        snprintf(global_status, sizeof(global_status), "Pattern not found: %.*s", (int)s->len, s->pat);
+        return;
+    }
+    global_cursor = at;
+    if (wrapped) {
+        snprintf(global_status, sizeof(global_status), "%s",
+                 backward ? "Search hit TOP, continuing at BOTTOM" : "Search hit BOTTOM, continuing at TOP");
+    }
+}
+
+static void editor_search_finish(void) {
+    if (global_cmd_len == 0) {
+        // An empty pattern searches for the last one again
+        bool backward = (global_cmd_prompt == '?');
+        editor_leave_command_mode();
+        global_search = search_saved;
+        global_search.backward = backward;
+        editor_search_next(false);
+        return;
+    }
+
+    if (!editor_search_update()) {
+        snprintf(global_status, sizeof(global_status), "Pattern not found: %s", global_cmd);
+    }
+    editor_leave_command_mode();
+}
+
 static void editor_command_keypress(int key) {
+    bool search = (global_cmd_prompt != ':');
     if (key == ESC) {
-        editor_leave_command_mode();
+        if (search) editor_search_cancel();
+        else editor_leave_command_mode();
         return;
     }
     if (key == ENTER || key == '\r') {
-        editor_execute_command();
+        if (search) editor_search_finish();
+        else editor_execute_command();
         return;
     }
     if (key == BACKSPACE || key == DEL) {
         if (global_cmd_len > 0) {
             global_cmd_len--;
             global_cmd[global_cmd_len] = '\0';
+            if (search) editor_search_update();
+        } else if (search) {
+            editor_search_cancel();
         } else {
             editor_leave_command_mode();
         }
@@ -1218,22 +4957,57 @@ static void editor_command_keypress(int key) {
     if (isprint(key) && global_cmd_len + 1 < sizeof(global_cmd)) {
         global_cmd[global_cmd_len++] = (char)key;
         global_cmd[global_cmd_len] = '\0';
+        if (search) editor_search_update();
     }
 }
 
 /* ---- main input loop ----- */
 
+// Inserts a bracketed paste in one go: one splice, one syntax
+// pass and one redraw, however many lines it has. On the command
+// line, the first line of it is typed in.
+static void editor_paste(void) {
+    struct abuf text = ABUF_INIT;
+    editor_read_paste(&text);
+
+    if (global_mode == COMMAND) {
+        for (int i = 0; i < text.len && text.b[i] != '\n'; i++) {
+            if (isprint((unsigned char)text.b[i]) && global_cmd_len + 1 < sizeof(global_cmd)) {
+                global_cmd[global_cmd_len++] = text.b[i];
+            }
+        }
+        global_cmd[global_cmd_len] = '\0';
+        if (global_cmd_prompt != ':') editor_search_update();
+    } else if (text.len > 0 && global_cursor.row < global_buffer.line_count) {
+        // Typed into an insert, it's part of that step
+        if (global_mode != INSERT) undo_break(&global_undo);
+        Line *l = buffer_line(&global_buffer, global_cursor.row);
+        editor_record_edit(UNDO_INSERT, global_cursor.row, MIN(global_cursor.col, l->len), text.b, (size_t)text.len);
+        buffer_insert_text(&global_buffer, &global_cursor, text.b, (size_t)text.len);
+        editor_mark_dirty();
+    }
+    abFree(&text);
+}
+
 static void editor_process_keypress(void) {
     int key = editor_read_key();
+    if (key == NO_KEY) return;
 
     if (global_mode != COMMAND) global_status[0] = '\0';
 
+    if (key == PASTE) {
+        editor_paste();
+        return;
+    }
+
     if (global_mode == COMMAND) {
         editor_command_keypress(key);
         return;
     }
 
     if (key == ARROW_UP || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_RIGHT) {
+        // Typing after moving is a separate undo step
+        undo_break(&global_undo);
         editor_move_cursor(key);
         return;
     }
@@ -1241,6 +5015,7 @@ static void editor_process_keypress(void) {
     if (global_mode == INSERT) {
         if (key == ESC) {
             global_mode = NORMAL;
+            undo_break(&global_undo);
             return;
         }
         if (key == ENTER || key == '\r') {
@@ -1263,8 +5038,11 @@ static void editor_process_keypress(void) {
     }
 
     // NORMAL mode
-    if (key == 'i') { global_mode = INSERT; return; }
-    if (key == ':') { editor_enter_command_mode(); return; }
+    if (key == 'i') { global_mode = INSERT; undo_break(&global_undo); return; }
+    if (key == ':') { editor_enter_command_mode(':'); return; }
+    if (key == '/' || key == '?') { editor_search_start((char)key); return; }
+    if (key == 'n') { editor_search_next(false); return; }
+    if (key == 'N') { editor_search_next(true); return; }
     if (key == ESC) { global_mode = NORMAL; return; }
 
     if (key == 'h') { editor_move_cursor(ARROW_LEFT); return; }
@@ -1272,18 +5050,37 @@ static void editor_process_keypress(void) {
     if (key == 'k') { editor_move_cursor(ARROW_UP); return; }
     if (key == 'l') { editor_move_cursor(ARROW_RIGHT); return; }
 
+    if (key == 'u') { editor_undo(); return; }
+    if (key == CTRL_KEY('r')) { editor_redo(); return; }
+
 	if (key == 'x') { 
-		line_delete_char(&global_buffer.lines[global_cursor.row], global_cursor.col);
+		Line *l = buffer_line(&global_buffer, global_cursor.row);
+		if (global_cursor.col < l->len) {
+			undo_break(&global_undo);
+			editor_record_edit(UNDO_DELETE, global_cursor.row, global_cursor.col, &l->data[global_cursor.col], 1);
+			line_delete_char(&global_buffer.pool, l, global_cursor.col);
+			buffer_line_changed(&global_buffer, global_cursor.row);
+			editor_mark_dirty();
+		}
 		return;
 	}
 
     if (key == 'd') {
         global_control_char = 'd';
         editor_refresh_screen();
-        int other_key = editor_read_key();
+        int other_key;
+        do {
+            other_key = editor_read_key();
+        } while (other_key == NO_KEY);
+        if (other_key == PASTE) {
+            global_control_char = ' ';
+            editor_paste();
+            return;
+        }
         if (other_key == 'd') {
             global_control_char = ' ';
-            buffer_delete_line(&global_buffer, global_cursor.row);
+            undo_break(&global_undo);
+            editor_delete_line();
         } else {
             global_control_char = ' ';
             return;
@@ -1292,6 +5089,24 @@ static void editor_process_keypress(void) {
 }
 
 int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "--bench-load") == 0) {
+        return bench_load(argv[2]);
+    }
+    if (argc >= 3 && strcmp(argv[1], "--bench-highlight") == 0) {
+        return bench_highlight(argv[2]);
+    }
+    if (argc >= 3 && strcmp(argv[1], "--bench-rows") == 0) {
+        return bench_rows(argv[2]);
+    }
+
+    // -r file: replay the edits a crashed session left in file's journal
+    bool recover = false;
+    if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+        recover = true;
+        argv++;
+        argc--;
+    }
+
     buffer_init(&global_buffer);    
 
     if (argc >= 2) {
@@ -1300,11 +5115,11 @@ int main(int argc, char *argv[]) {
         if (fp) {
             buffer_load_file(&global_buffer, fp);
             global_dirty = false;
-            editor_update_syntax_from(0);
         } else {
             global_dirty = false;
             snprintf(global_status, sizeof(global_status), "New file");
         }
+        journal_open(&global_buffer, global_filename, recover);
     } else {
         global_filename = NULL;
         snprintf(global_status, sizeof(global_status), "No file (use :w <path>)");
@@ -1314,17 +5129,30 @@ int main(int argc, char *argv[]) {
     global_cursor.col = 0;
     global_view.top_line = 0;
     global_view.top_rowoff = 0;
+    global_view.left_col = 0;
+
+    syntax_init();
+    editor_select_syntax();
 
     enable_raw_mode();
+    editor_init_events();
+    editor_hl_start();
+    journal_start();
     write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
 
     while (editor_running) {
-        editor_refresh_screen();
+        if (editor_frame_due()) editor_refresh_screen();
         editor_process_keypress();
+        frame_pending = true;
     }
 
-    write(STDOUT_FILENO, "\x1b[2J\x1b[H\x1b[?25h", 13);
+    editor_poll_save(true);
+    journal_close();
+    write(STDOUT_FILENO, "\x1b[m\x1b[2J\x1b[H\x1b[?25h", 16);
     buffer_free(&global_buffer);
+    undo_free(&global_undo);
+    screen_free(&global_screen);
     free(global_filename_owned);
+    free(save_path);
     return 0;
 }
\ No newline at end of file